@@ -0,0 +1,430 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include "../lsystem.hpp"
+#include "../modulo_int_system.hpp"
+
+using namespace std;
+using namespace trlsai::lsystem;
+
+using IntSystem = System<int, empty, int>;
+using IntDurationSystem = System<int, Duration, ModuloValue>;
+
+// Counted per thread, so measurements only include allocations made by the
+// thread running the engine, not by helper threads such as prefetch producers.
+static thread_local unsigned long long allocation_count = 0;
+static thread_local unsigned long long allocation_bytes = 0;
+
+void *operator new(size_t size) {
+    ++allocation_count;
+    allocation_bytes += size;
+    void *ptr = malloc(size == 0 ? 1 : size);
+    if (ptr == nullptr) {
+        throw bad_alloc();
+    }
+    return ptr;
+}
+
+void operator delete(void *ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    free(ptr);
+}
+
+class HardwareCounters {
+public:
+    HardwareCounters(): available(false) {
+        this->descriptors[0] = this->open_counter(PERF_COUNT_HW_CPU_CYCLES, -1);
+        this->descriptors[1] = this->open_counter(PERF_COUNT_HW_INSTRUCTIONS, this->descriptors[0]);
+        this->descriptors[2] = this->open_counter(PERF_COUNT_HW_CACHE_MISSES, this->descriptors[0]);
+        this->available = this->descriptors[0] >= 0 && this->descriptors[1] >= 0 && this->descriptors[2] >= 0;
+        for (int j = 0; j < 3; ++j) {
+            this->values[j] = 0;
+        }
+    }
+
+    ~HardwareCounters() {
+#ifdef __linux__
+        for (int j = 0; j < 3; ++j) {
+            if (this->descriptors[j] >= 0) {
+                close(this->descriptors[j]);
+            }
+        }
+#endif
+    }
+
+    bool is_available() const {
+        return this->available;
+    }
+
+    void start() {
+#ifdef __linux__
+        if (this->available) {
+            ioctl(this->descriptors[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            ioctl(this->descriptors[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+#endif
+    }
+
+    void stop() {
+#ifdef __linux__
+        if (this->available) {
+            ioctl(this->descriptors[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+            for (int j = 0; j < 3; ++j) {
+                unsigned long long value = 0;
+                if (read(this->descriptors[j], &value, sizeof(value)) == static_cast<ssize_t>(sizeof(value))) {
+                    this->values[j] = value;
+                }
+            }
+        }
+#endif
+    }
+
+    unsigned long long cycles() const {
+        return this->values[0];
+    }
+
+    unsigned long long instructions() const {
+        return this->values[1];
+    }
+
+    unsigned long long cache_misses() const {
+        return this->values[2];
+    }
+
+private:
+    bool available;
+    int descriptors[3];
+    unsigned long long values[3];
+
+    int open_counter(unsigned long long config, int group) {
+#ifdef __linux__
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = config;
+        attr.disabled = group < 0;
+        attr.exclude_kernel = true;
+        attr.exclude_hv = true;
+        return static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, group, 0));
+#else
+        return -1;
+#endif
+    }
+};
+
+// Resets the resident set high-water mark where the kernel allows it, so
+// each run reports its own peak instead of the process-wide one.
+static void reset_peak_rss() {
+    ofstream clear_refs("/proc/self/clear_refs");
+    if (clear_refs) {
+        clear_refs << "5";
+    }
+}
+
+static long peak_rss_kb() {
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line)) {
+        if (line.compare(0, 6, "VmHWM:") == 0) {
+            return atol(line.c_str() + 6);
+        }
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+struct Measurement {
+    string engine;
+    string rules;
+    string materialiser;
+    unsigned int depth;
+    unsigned long long symbols;
+    double seconds;
+    unsigned long long allocations;
+    unsigned long long allocated_bytes;
+    long peak_rss_kb;
+    bool has_counters;
+    unsigned long long cycles;
+    unsigned long long instructions;
+    unsigned long long cache_misses;
+};
+
+template <typename SYSTEM>
+struct Engine {
+    Engine(string name, function<unsigned long long(SYSTEM&, typename SYSTEM::TreeNode&, unsigned int)> run,
+           function<bool(SYSTEM&, typename SYSTEM::TreeNode&)> supports = nullptr)
+        : name(name), run(run), supports(supports) { }
+    string name;
+    function<unsigned long long(SYSTEM&, typename SYSTEM::TreeNode&, unsigned int)> run;
+    // Whether the engine can run the system at all; engines without it run
+    // everything.
+    function<bool(SYSTEM&, typename SYSTEM::TreeNode&)> supports;
+};
+
+template <typename SYSTEM>
+static unsigned long long drain(shared_ptr<Iterator<typename SYSTEM::TreeNode>> it) {
+    unsigned long long symbols = 0;
+    while (it->has_next()) {
+        it->next();
+        ++symbols;
+    }
+    return symbols;
+}
+
+template <typename SYSTEM>
+static vector<Engine<SYSTEM>> engines() {
+    using TreeNode = typename SYSTEM::TreeNode;
+    vector<Engine<SYSTEM>> result;
+
+    result.push_back(Engine<SYSTEM>("eager", [](SYSTEM &system, TreeNode &original, unsigned int depth) {
+        return static_cast<unsigned long long>(system.expand(original, static_cast<int>(depth)).size());
+    }));
+
+    result.push_back(Engine<SYSTEM>("lazy", [](SYSTEM &system, TreeNode &original, unsigned int depth) {
+        system.set_leaf_fusion_depth(1);
+        return drain<SYSTEM>(system.lazy_expand(original, depth));
+    }));
+
+    result.push_back(Engine<SYSTEM>("lazy_fused3", [](SYSTEM &system, TreeNode &original, unsigned int depth) {
+        system.set_leaf_fusion_depth(fused_engine_depth);
+        return drain<SYSTEM>(system.lazy_expand(original, depth));
+    }));
+
+    result.push_back(Engine<SYSTEM>("generator", [](SYSTEM &system, TreeNode &original, unsigned int depth) {
+        return drain<SYSTEM>(system.generate(original, depth));
+    }));
+
+    result.push_back(Engine<SYSTEM>("bounded", [](SYSTEM &system, TreeNode &original, unsigned int depth) {
+        return drain<SYSTEM>(system.bounded_expand(original, depth));
+    }));
+
+    // The expansion runs on the producer thread, so allocations are the
+    // consumer's only; the time covers both, as it's wall time.
+    result.push_back(Engine<SYSTEM>("prefetch", [](SYSTEM &system, TreeNode &original, unsigned int depth) {
+        auto it = system.prefetch_expand(original, depth);
+        auto prefetch = static_pointer_cast<PrefetchIterator<TreeNode>>(it);
+        vector<TreeNode> batch(256);
+        unsigned long long symbols = 0;
+        while (prefetch->has_next()) {
+            symbols += prefetch->next_batch(batch.data(), batch.size());
+        }
+        return symbols;
+    }));
+
+    result.push_back(Engine<SYSTEM>("for_each", [](SYSTEM &system, TreeNode &original, unsigned int depth) {
+        unsigned long long symbols = 0;
+        system.for_each(original, depth, [&symbols](TreeNode &) {
+            ++symbols;
+            return true;
+        });
+        return symbols;
+    }));
+
+    // Includes compiling the table; systems that aren't finite-state are
+    // skipped.
+    result.push_back(Engine<SYSTEM>("d0l", [](SYSTEM &system, TreeNode &original, unsigned int depth) {
+        D0LSystem<TreeNode> d0l;
+        compile_d0l(system, original, 4096, d0l);
+        unsigned long long symbols = 0;
+        auto it = d0l.lazy_expand(d0l.root(), depth);
+        while (it->has_next()) {
+            it->next();
+            ++symbols;
+        }
+        return symbols;
+    }, [](SYSTEM &system, TreeNode &original) {
+        D0LSystem<TreeNode> d0l;
+        return compile_d0l(system, original, 4096, d0l);
+    }));
+
+    return result;
+}
+
+struct Options {
+    Options(): json(false), depths({ 12, 16, 20 }) { }
+    bool json;
+    string engine;
+    vector<unsigned int> depths;
+};
+
+template <typename SYSTEM>
+static void run_engines(const Options &options, vector<Measurement> &results, const string &rules_name,
+                        const string &materialiser_name, function<shared_ptr<SYSTEM>()> make_system,
+                        typename SYSTEM::TreeNode original) {
+    auto available = engines<SYSTEM>();
+    for (auto engine = available.begin(); engine != available.end(); ++engine) {
+        if (!options.engine.empty() && options.engine != engine->name) {
+            continue;
+        }
+        typename SYSTEM::TreeNode checked = original;
+        if (engine->supports && !engine->supports(*make_system(), checked)) {
+            cerr << engine->name << " can't run " << rules_name << "/" << materialiser_name << ", skipped" << endl;
+            continue;
+        }
+
+        for (auto depth = options.depths.begin(); depth != options.depths.end(); ++depth) {
+            auto system = make_system();
+            typename SYSTEM::TreeNode root = original;
+            HardwareCounters counters;
+
+            reset_peak_rss();
+            unsigned long long allocations = allocation_count;
+            unsigned long long bytes = allocation_bytes;
+            counters.start();
+            auto start = chrono::steady_clock::now();
+
+            unsigned long long symbols = engine->run(*system, root, *depth);
+
+            auto end = chrono::steady_clock::now();
+            counters.stop();
+
+            Measurement measurement;
+            measurement.engine = engine->name;
+            measurement.rules = rules_name;
+            measurement.materialiser = materialiser_name;
+            measurement.depth = *depth;
+            measurement.symbols = symbols;
+            measurement.seconds = chrono::duration<double>(end - start).count();
+            measurement.allocations = allocation_count - allocations;
+            measurement.allocated_bytes = allocation_bytes - bytes;
+            measurement.peak_rss_kb = peak_rss_kb();
+            measurement.has_counters = counters.is_available();
+            measurement.cycles = counters.cycles();
+            measurement.instructions = counters.instructions();
+            measurement.cache_misses = counters.cache_misses();
+            results.push_back(measurement);
+        }
+    }
+}
+
+static double per_symbol(double value, unsigned long long symbols) {
+    return symbols == 0 ? 0.0 : value / static_cast<double>(symbols);
+}
+
+static void print_json(const vector<Measurement> &results) {
+    cout << "[" << endl;
+    for (size_t j = 0; j < results.size(); ++j) {
+        const Measurement &m = results[j];
+        cout << "  {\"engine\": \"" << m.engine << "\", \"rules\": \"" << m.rules
+             << "\", \"materialiser\": \"" << m.materialiser << "\", \"depth\": " << m.depth
+             << ", \"symbols\": " << m.symbols
+             << ", \"seconds\": " << m.seconds
+             << ", \"ns_per_symbol\": " << per_symbol(m.seconds * 1e9, m.symbols)
+             << ", \"allocations_per_symbol\": " << per_symbol(static_cast<double>(m.allocations), m.symbols)
+             << ", \"bytes_per_symbol\": " << per_symbol(static_cast<double>(m.allocated_bytes), m.symbols)
+             << ", \"peak_rss_kb\": " << m.peak_rss_kb;
+        if (m.has_counters) {
+            cout << ", \"cycles\": " << m.cycles
+                 << ", \"instructions\": " << m.instructions
+                 << ", \"cache_misses\": " << m.cache_misses;
+        } else {
+            cout << ", \"cycles\": null, \"instructions\": null, \"cache_misses\": null";
+        }
+        cout << "}" << (j + 1 < results.size() ? "," : "") << endl;
+    }
+    cout << "]" << endl;
+}
+
+static void print_table(const vector<Measurement> &results) {
+    for (auto it = results.begin(); it != results.end(); ++it) {
+        cout << it->engine << " " << it->rules << "/" << it->materialiser << " depth " << it->depth
+             << ": " << it->symbols << " symbols, "
+             << per_symbol(it->seconds * 1e9, it->symbols) << " ns/symbol, "
+             << per_symbol(static_cast<double>(it->allocations), it->symbols) << " allocs/symbol, "
+             << it->peak_rss_kb << " kB peak RSS";
+        if (it->has_counters) {
+            cout << ", " << per_symbol(static_cast<double>(it->cycles), it->symbols) << " cycles/symbol, "
+                 << per_symbol(static_cast<double>(it->instructions), it->symbols) << " instructions/symbol, "
+                 << it->cache_misses << " cache misses";
+        }
+        cout << endl;
+    }
+}
+
+static bool parse_options(int argc, char **argv, Options &options) {
+    for (int j = 1; j < argc; ++j) {
+        string arg = argv[j];
+        if (arg == "--json") {
+            options.json = true;
+        } else if (arg == "--engine" && j + 1 < argc) {
+            options.engine = argv[++j];
+        } else if (arg == "--depths" && j + 1 < argc) {
+            options.depths.clear();
+            stringstream depths(argv[++j]);
+            string depth;
+            while (getline(depths, depth, ',')) {
+                options.depths.push_back(static_cast<unsigned int>(atoi(depth.c_str())));
+            }
+        } else {
+            cerr << "Usage: " << argv[0] << " [--json] [--engine NAME] [--depths D1,D2,...]" << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    if (!parse_options(argc, argv, options)) {
+        return 1;
+    }
+
+    vector<Measurement> results;
+
+    run_engines<IntSystem>(options, results, "case1", "modulo_int", []() {
+        auto rules = make_shared<IntSystem::Rules>();
+        (*rules)[1] = { 1, 2, 3 };
+        (*rules)[2] = { 3, -1 };
+        (*rules)[3] = { 1, 4, 3 };
+        (*rules)[-1] = { 3, -3 };
+        (*rules)[-3] = { 2, -3 };
+        return make_shared<IntSystem>(rules, make_shared<ModuloIntMaterialiser>(-3, 4));
+    }, IntSystem::TreeNode(1, 1));
+
+    run_engines<IntSystem>(options, results, "case2", "modulo_int", []() {
+        auto rules = make_shared<IntSystem::Rules>();
+        (*rules)[0] = { 1, 0, 2 };
+        (*rules)[1] = { 1, 3 };
+        (*rules)[2] = { 1 };
+        return make_shared<IntSystem>(rules, make_shared<ModuloIntMaterialiser>(0, 4));
+    }, IntSystem::TreeNode(0, 0));
+
+    run_engines<IntDurationSystem>(options, results, "case1", "modulo_duration", []() {
+        using R = RuleNode<int, Duration>;
+        auto rules = make_shared<IntDurationSystem::Rules>();
+        (*rules)[1] = { R(1, 1), R(2, 1), R(3, Duration(1, 2)) };
+        (*rules)[2] = { R(3, Duration(1, 5)), R(-1, 1) };
+        (*rules)[3] = { R(1, 1), R(4, 2), R(3, 2) };
+        (*rules)[-1] = { R(3, 4), R(-3, 1) };
+        (*rules)[-3] = { R(2, 5), R(-3, 2) };
+        return make_shared<IntDurationSystem>(rules, make_shared<ModuloDurationMaterialiser>(-3, 4));
+    }, IntDurationSystem::TreeNode(1, Duration(1), ModuloValue(1, Duration(1))));
+
+    if (options.json) {
+        print_json(results);
+    } else {
+        print_table(results);
+    }
+
+    return 0;
+}
@@ -0,0 +1,289 @@
+#ifndef __MODAL_LSYSTEM_BOUNDED_ITERATOR__
+#define __MODAL_LSYSTEM_BOUNDED_ITERATOR__
+
+#include <memory>
+#include <vector>
+#include "lazy_iterator.hpp"
+#include "checkpoint.hpp"
+
+using namespace std;
+
+namespace trlsai {
+    namespace lsystem {
+        template <typename SYSTEM>
+        struct AcceptAll {
+            bool accept(typename SYSTEM::TreeNode &, unsigned int) {
+                return true;
+            }
+        };
+
+        // Depth-first traversal that keeps exactly one frame per level: the
+        // current node at that level, the rule it expands with and the index of
+        // the next child. Children are produced one at a time straight from the
+        // rule, so there are no successor vectors and the frames are allocated
+        // once, in the constructor. Memory is required_bytes(iterations) for the
+        // whole traversal, regardless of the branching of the rules.
+        //
+        // Frames keep rule pointers between calls, so each frame also holds
+        // the rules its pointer comes from: in concurrent mode, updates
+        // replace the rules, and those a frame still reads are only freed once
+        // it moves on to another node.
+        //
+        // FILTER::accept(node, remaining) is asked about every node produced,
+        // with the number of levels left below it; rejected nodes are skipped
+        // along with their whole subtree.
+        template <typename SYSTEM, typename FILTER = AcceptAll<SYSTEM>>
+        class BoundedLazyIterator : public Iterator<typename SYSTEM::TreeNode> {
+        public:
+            using TreeNode = typename SYSTEM::TreeNode;
+
+            struct Frame {
+                Frame(const TreeNode &node): node(node), rule(nullptr), index(0) { }
+                TreeNode node;
+                const typename SYSTEM::RuleList *rule;
+                shared_ptr<const typename SYSTEM::Rules> rules;
+                size_t index;
+            };
+
+            BoundedLazyIterator(SYSTEM *system, TreeNode &original, unsigned int iterations, FILTER filter = FILTER())
+                : Iterator<TreeNode>(), system(system), filter(filter), depth(iterations), level(0),
+                  _has_next(false), exhausted(true) {
+                this->frames.reserve(static_cast<size_t>(iterations) + 1);
+                for (unsigned int j = 0; j <= iterations; ++j) {
+                    this->frames.push_back(Frame(original));
+                }
+                this->reseed(original, iterations);
+            }
+
+            // Restarts the traversal from another node, reusing the frames.
+            // Fails, leaving the iterator as it was, if iterations is deeper
+            // than the iterator was built for.
+            bool reseed(TreeNode &original, unsigned int iterations) {
+                if (static_cast<size_t>(iterations) >= this->frames.size()) {
+                    return false;
+                }
+
+                this->depth = iterations;
+                this->level = 0;
+                this->frames[0].node = original;
+                this->frames[0].rule = this->system->find_rule(original.key, this->frames[0].rules);
+                this->frames[0].index = 0;
+
+                bool accepted = this->filter.accept(original, iterations);
+                this->_has_next = accepted && iterations == 0;
+                this->exhausted = !accepted || iterations == 0;
+                return true;
+            }
+
+            // Records the position, leaving the rules fingerprint to the
+            // caller. The traversal first moves down to the bottom level,
+            // without producing an element, so every level has an index.
+            void save(TraversalCheckpoint<TreeNode> &checkpoint) {
+                this->settle();
+                checkpoint.root = this->frames[0].node;
+                checkpoint.iterations = this->depth;
+                checkpoint.path.clear();
+                for (size_t j = 0; j < TraversalCheckpoint<TreeNode>::levels(this->depth); ++j) {
+                    checkpoint.path.push_back(this->frames[j].index);
+                }
+                checkpoint.pending = this->_has_next;
+                checkpoint.exhausted = this->exhausted;
+            }
+
+            // Moves to a saved position, producing one child per level to get
+            // there. Fails on a path the current rules can't have produced,
+            // leaving the iterator at the start of the checkpoint's root.
+            bool restore(const TraversalCheckpoint<TreeNode> &checkpoint) {
+                const vector<size_t> &path = checkpoint.path;
+                if (path.size() != TraversalCheckpoint<TreeNode>::levels(checkpoint.iterations)) {
+                    return false;
+                }
+                TreeNode root = checkpoint.root;
+                if (!this->reseed(root, checkpoint.iterations)) {
+                    return false;
+                }
+                // At depth zero the root is the whole traversal: it's either
+                // still pending or already returned.
+                if (checkpoint.exhausted || this->depth == 0) {
+                    if (!checkpoint.exhausted || (checkpoint.pending && !this->_has_next)) {
+                        this->reseed(root, checkpoint.iterations);
+                        return false;
+                    }
+                    this->_has_next = checkpoint.pending;
+                    this->exhausted = true;
+                    return true;
+                }
+                if (checkpoint.pending && path.back() == 0) {
+                    this->reseed(root, checkpoint.iterations);
+                    return false;
+                }
+
+                for (size_t j = 0; j < path.size(); ++j) {
+                    Frame &frame = this->frames[j];
+                    bool last = j + 1 == path.size();
+                    if (path[j] > SYSTEM::child_count(frame.rule) || (path[j] == 0 && !last)) {
+                        this->reseed(root, checkpoint.iterations);
+                        return false;
+                    }
+
+                    frame.index = path[j];
+                    if (frame.index > 0) {
+                        Frame &child = this->frames[j + 1];
+                        child.node = this->system->produce_child(frame.node, frame.rule, frame.index - 1);
+                        if (!last) {
+                            child.rule = this->system->find_rule(child.node.key, child.rules);
+                        }
+                    }
+                }
+
+                this->level = static_cast<unsigned int>(path.size() - 1);
+                this->_has_next = checkpoint.pending;
+                this->exhausted = false;
+                return true;
+            }
+
+            static size_t required_bytes(unsigned int iterations) {
+                return sizeof(BoundedLazyIterator<SYSTEM, FILTER>) + (static_cast<size_t>(iterations) + 1) * sizeof(Frame);
+            }
+
+            size_t allocated_bytes() const {
+                return sizeof(*this) + this->frames.capacity() * sizeof(Frame);
+            }
+
+            bool has_next() override {
+                this->check_next();
+                return this->_has_next;
+            }
+
+            TreeNode &next() override {
+                this->check_next();
+                this->_has_next = false;
+                return this->frames[this->depth].node;
+            }
+
+            unsigned long long advance(unsigned long long n) override {
+                return this->advance(n, &this->filter);
+            }
+
+        private:
+            SYSTEM *system;
+            FILTER filter;
+            vector<Frame> frames;
+            unsigned int depth;
+            unsigned int level;
+            bool _has_next;
+            bool exhausted;
+
+            // Filters can drop nodes inside a subtree, so only unfiltered
+            // traversals know how many elements a subtree holds. An impure
+            // materialiser can't have its subtrees measured without producing
+            // them, which would change the nodes produced afterwards.
+            template <typename OTHER>
+            unsigned long long advance(unsigned long long n, OTHER *) {
+                return Iterator<TreeNode>::advance(n);
+            }
+
+            unsigned long long advance(unsigned long long n, AcceptAll<SYSTEM> *) {
+                if (!this->system->has_pure_materialiser()) {
+                    return Iterator<TreeNode>::advance(n);
+                }
+
+                unsigned long long skipped = 0;
+                if (this->_has_next && n > 0) {
+                    this->_has_next = false;
+                    ++skipped;
+                }
+
+                while (skipped < n && !this->exhausted) {
+                    Frame &frame = this->frames[this->level];
+                    if (frame.index < SYSTEM::child_count(frame.rule)) {
+                        Frame &child = this->frames[this->level + 1];
+                        child.node = this->system->produce_child(frame.node, frame.rule, frame.index);
+                        ++frame.index;
+
+                        unsigned int remaining = this->depth - this->level - 1;
+                        unsigned long long length = this->system->length(child.node, remaining);
+                        if (length <= n - skipped) {
+                            skipped += length;
+                            continue;
+                        }
+
+                        ++this->level;
+                        child.rule = this->system->find_rule(child.node.key, child.rules);
+                        child.index = 0;
+                    } else if (this->level == 0) {
+                        this->exhausted = true;
+                    } else {
+                        --this->level;
+                    }
+                }
+                return skipped;
+            }
+
+            // check_next() up to the bottom level, stopping before it would
+            // produce an element there.
+            void settle() {
+                if (this->_has_next || this->exhausted) {
+                    return;
+                }
+
+                while (this->level + 1 < this->depth) {
+                    Frame &frame = this->frames[this->level];
+                    if (frame.index < SYSTEM::child_count(frame.rule)) {
+                        Frame &child = this->frames[this->level + 1];
+                        child.node = this->system->produce_child(frame.node, frame.rule, frame.index);
+                        ++frame.index;
+
+                        if (!this->filter.accept(child.node, this->depth - this->level - 1)) {
+                            continue;
+                        }
+
+                        ++this->level;
+                        child.rule = this->system->find_rule(child.node.key, child.rules);
+                        child.index = 0;
+                    } else if (this->level == 0) {
+                        this->exhausted = true;
+                        return;
+                    } else {
+                        --this->level;
+                    }
+                }
+            }
+
+            void check_next() {
+                if (this->_has_next || this->exhausted) {
+                    return;
+                }
+
+                while (true) {
+                    Frame &frame = this->frames[this->level];
+                    if (frame.index < SYSTEM::child_count(frame.rule)) {
+                        Frame &child = this->frames[this->level + 1];
+                        child.node = this->system->produce_child(frame.node, frame.rule, frame.index);
+                        ++frame.index;
+
+                        if (!this->filter.accept(child.node, this->depth - this->level - 1)) {
+                            continue;
+                        }
+
+                        if (this->level + 1 == this->depth) {
+                            this->_has_next = true;
+                            return;
+                        }
+
+                        ++this->level;
+                        child.rule = this->system->find_rule(child.node.key, child.rules);
+                        child.index = 0;
+                    } else if (this->level == 0) {
+                        this->exhausted = true;
+                        return;
+                    } else {
+                        --this->level;
+                    }
+                }
+            }
+        };
+    }
+}
+
+#endif
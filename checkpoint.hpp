@@ -0,0 +1,135 @@
+#ifndef __MODAL_LSYSTEM_CHECKPOINT__
+#define __MODAL_LSYSTEM_CHECKPOINT__
+
+#include <cstring>
+#include <limits>
+#include <type_traits>
+#include <vector>
+
+using namespace std;
+
+namespace trlsai {
+    namespace lsystem {
+        // Stores nodes as their bytes, which suits nodes without pointers, like
+        // the modulo systems' ones. Other node types need a codec of their own
+        // with the same two methods.
+        template <typename TREENODE>
+        struct TrivialNodeCodec {
+            static_assert(is_trivially_copyable<TREENODE>::value, "nodes with pointers need a codec of their own");
+
+            void encode(const TREENODE &node, vector<unsigned char> &bytes) const {
+                const unsigned char *first = reinterpret_cast<const unsigned char *>(&node);
+                bytes.insert(bytes.end(), first, first + sizeof(TREENODE));
+            }
+
+            bool decode(const vector<unsigned char> &bytes, size_t &offset, TREENODE &node) const {
+                if (bytes.size() - offset < sizeof(TREENODE)) {
+                    return false;
+                }
+                memcpy(&node, bytes.data() + offset, sizeof(TREENODE));
+                offset += sizeof(TREENODE);
+                return true;
+            }
+        };
+
+        // Position of a depth-first traversal: the root and depth it expands,
+        // a fingerprint of the rules it ran against, and for every level the
+        // index of the next child to produce. That's enough to rebuild the
+        // traversal with one materialiser call per level. Paths always have
+        // one index per level, or a single one for depth zero, so a decoder
+        // can't be made to build more levels than its input holds indices for.
+        template <typename TREENODE>
+        struct TraversalCheckpoint {
+            TraversalCheckpoint(): iterations(0), rules_fingerprint(0), pending(false), exhausted(false) { }
+
+            TREENODE root;
+            unsigned int iterations;
+            unsigned long long rules_fingerprint;
+            vector<size_t> path;
+            // Whether the element at the bottom was found but not returned yet,
+            // and whether the traversal is over.
+            bool pending;
+            bool exhausted;
+
+            static size_t levels(unsigned int iterations) {
+                return iterations == 0 ? 1 : iterations;
+            }
+
+            // The root as written by codec, followed by the rest as
+            // little-endian base-128 varints.
+            template <typename CODEC = TrivialNodeCodec<TREENODE>>
+            vector<unsigned char> encode(CODEC codec = CODEC()) const {
+                vector<unsigned char> bytes;
+                codec.encode(this->root, bytes);
+                put(bytes, this->iterations);
+                put(bytes, this->rules_fingerprint);
+                put(bytes, (this->pending ? 1 : 0) | (this->exhausted ? 2 : 0));
+                put(bytes, this->path.size());
+                for (auto index = this->path.begin(); index != this->path.end(); ++index) {
+                    put(bytes, *index);
+                }
+                return bytes;
+            }
+
+            // Reads what encode() wrote. Fails on truncated or malformed
+            // input, leaving the checkpoint as it was.
+            template <typename CODEC = TrivialNodeCodec<TREENODE>>
+            bool decode(const vector<unsigned char> &bytes, CODEC codec = CODEC()) {
+                size_t offset = 0;
+                TREENODE root;
+                unsigned long long iterations, fingerprint, flags, levels;
+                if (!codec.decode(bytes, offset, root) || !get(bytes, offset, iterations) ||
+                    !get(bytes, offset, fingerprint) || !get(bytes, offset, flags) || !get(bytes, offset, levels) ||
+                    iterations > numeric_limits<unsigned int>::max() || flags > 3 ||
+                    levels != TraversalCheckpoint::levels(static_cast<unsigned int>(iterations)) ||
+                    levels > bytes.size() - offset) {
+                    return false;
+                }
+
+                vector<size_t> path;
+                path.reserve(static_cast<size_t>(levels));
+                for (unsigned long long j = 0; j < levels; ++j) {
+                    unsigned long long index;
+                    if (!get(bytes, offset, index) || index > numeric_limits<size_t>::max()) {
+                        return false;
+                    }
+                    path.push_back(static_cast<size_t>(index));
+                }
+                if (offset != bytes.size()) {
+                    return false;
+                }
+
+                this->root = root;
+                this->iterations = static_cast<unsigned int>(iterations);
+                this->rules_fingerprint = fingerprint;
+                this->pending = (flags & 1) != 0;
+                this->exhausted = (flags & 2) != 0;
+                this->path.swap(path);
+                return true;
+            }
+
+        private:
+            static void put(vector<unsigned char> &bytes, unsigned long long value) {
+                while (value >= 0x80) {
+                    bytes.push_back(static_cast<unsigned char>(value | 0x80));
+                    value >>= 7;
+                }
+                bytes.push_back(static_cast<unsigned char>(value));
+            }
+
+            static bool get(const vector<unsigned char> &bytes, size_t &offset, unsigned long long &value) {
+                value = 0;
+                for (unsigned int shift = 0; shift < 64 && offset < bytes.size(); shift += 7) {
+                    unsigned char byte = bytes[offset++];
+                    value |= static_cast<unsigned long long>(byte & 0x7f) << shift;
+                    if ((byte & 0x80) == 0) {
+                        return true;
+                    }
+                }
+                return false;
+            }
+        };
+    }
+}
+
+#endif
@@ -29,4 +29,8 @@ function(lsystem_configure_target target)
     -Wsign-conversion
     -Wfloat-conversion)
 
+  if(LSYSTEM_INSTRUMENTATION)
+    target_compile_definitions(${target} PUBLIC LSYSTEM_INSTRUMENTATION)
+  endif()
+
 endfunction()
@@ -0,0 +1,318 @@
+#ifndef __MODAL_LSYSTEM_D0L__
+#define __MODAL_LSYSTEM_D0L__
+
+#include <cmath>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include "lazy_iterator.hpp"
+
+using namespace std;
+
+namespace trlsai {
+    namespace lsystem {
+        using Symbol = unsigned int;
+
+        // A system lowered to a plain D0L system over dense integer symbols:
+        // every distinct node reachable from the root becomes a symbol, and
+        // its successors are stored as symbols too, so traversals only read
+        // the table and never call the materialiser.
+        template <typename TREENODE>
+        class D0LSystem {
+        public:
+            D0LSystem(): offsets({ 0 }) { }
+
+            size_t size() const {
+                return this->nodes.size();
+            }
+
+            Symbol root() const {
+                return 0;
+            }
+
+            const TREENODE &node(Symbol symbol) const {
+                return this->nodes[symbol];
+            }
+
+            const Symbol *successors_begin(Symbol symbol) const {
+                return this->successors.data() + this->offsets[symbol];
+            }
+
+            const Symbol *successors_end(Symbol symbol) const {
+                return this->successors.data() + this->offsets[symbol + 1];
+            }
+
+            size_t successor_count(Symbol symbol) const {
+                return this->offsets[symbol + 1] - this->offsets[symbol];
+            }
+
+            void expand(Symbol symbol, unsigned int iterations, vector<Symbol> &result) const {
+                if (iterations == 0) {
+                    result.push_back(symbol);
+                    return;
+                }
+                for (auto child = this->successors_begin(symbol); child != this->successors_end(symbol); ++child) {
+                    this->expand(*child, iterations - 1, result);
+                }
+            }
+
+            // Calls visitor(symbol) for every symbol of the given generation
+            // until it returns false. Returns false if the visitor stopped.
+            template <typename VISITOR>
+            bool for_each(Symbol symbol, unsigned int iterations, VISITOR &&visitor) const {
+                if (iterations == 0) {
+                    return visitor(symbol);
+                }
+                for (auto child = this->successors_begin(symbol); child != this->successors_end(symbol); ++child) {
+                    if (!this->for_each(*child, iterations - 1, visitor)) {
+                        return false;
+                    }
+                }
+                return true;
+            }
+
+            shared_ptr<Iterator<Symbol>> lazy_expand(Symbol symbol, unsigned int iterations) const;
+
+            // Number of symbols the given symbol expands to after the given
+            // number of iterations, from tables filled up to that depth. The
+            // tables are filled under a lock, since iterators over the same
+            // table fill them as they advance.
+            unsigned long long length(Symbol symbol, unsigned int iterations) const {
+                lock_guard<mutex> guard(this->lengths_lock);
+                while (this->lengths.size() <= iterations) {
+                    vector<unsigned long long> level(this->size(), 1);
+                    if (!this->lengths.empty()) {
+                        const vector<unsigned long long> &previous = this->lengths.back();
+                        for (Symbol s = 0; s < this->size(); ++s) {
+                            unsigned long long total = 0;
+                            for (auto child = this->successors_begin(s); child != this->successors_end(s); ++child) {
+                                total += previous[*child];
+                            }
+                            level[s] = total;
+                        }
+                    }
+                    this->lengths.push_back(level);
+                }
+                return this->lengths[iterations][symbol];
+            }
+
+            // Spectral radius of the symbol incidence matrix, the factor the
+            // length of the expansion eventually grows by each generation. It is
+            // estimated by power iteration from the all-ones vector, averaging
+            // over the second half of the steps so periodic systems converge too.
+            double growth_rate(unsigned int steps = 256) const {
+                vector<double> weights(this->size(), 1.0);
+                vector<double> next(this->size(), 0.0);
+                double log_growth = 0.0;
+                for (unsigned int step = 0; step < steps; ++step) {
+                    double total = 0.0;
+                    for (Symbol s = 0; s < this->size(); ++s) {
+                        double weight = 0.0;
+                        for (auto child = this->successors_begin(s); child != this->successors_end(s); ++child) {
+                            weight += weights[*child];
+                        }
+                        next[s] = weight;
+                        total += weight;
+                    }
+
+                    if (total == 0.0) {
+                        return 0.0;
+                    }
+                    for (Symbol s = 0; s < this->size(); ++s) {
+                        weights[s] = next[s] / total * static_cast<double>(this->size());
+                    }
+                    if (step >= steps / 2) {
+                        log_growth += log(total / static_cast<double>(this->size()));
+                    }
+                }
+                return exp(log_growth / static_cast<double>(steps - steps / 2));
+            }
+
+            Symbol add_node(const TREENODE &node) {
+                this->nodes.push_back(node);
+                return static_cast<Symbol>(this->nodes.size() - 1);
+            }
+
+            void add_successors(const vector<Symbol> &children) {
+                this->successors.insert(this->successors.end(), children.begin(), children.end());
+                this->offsets.push_back(this->successors.size());
+            }
+
+        private:
+            vector<TREENODE> nodes;
+            vector<size_t> offsets;
+            vector<Symbol> successors;
+            mutable vector<vector<unsigned long long>> lengths;
+            mutable mutex lengths_lock;
+        };
+
+        template <typename TREENODE>
+        class D0LIterator : public Iterator<Symbol> {
+        public:
+            D0LIterator(const D0LSystem<TREENODE> *d0l, Symbol symbol, unsigned int iterations)
+                : Iterator<Symbol>(), d0l(d0l), depth(iterations), level(0),
+                  _has_next(iterations == 0), exhausted(iterations == 0) {
+                this->symbols.assign(static_cast<size_t>(iterations) + 1, symbol);
+                this->indices.assign(static_cast<size_t>(iterations) + 1, 0);
+            }
+
+            bool has_next() override {
+                this->check_next();
+                return this->_has_next;
+            }
+
+            Symbol &next() override {
+                this->check_next();
+                this->_has_next = false;
+                return this->symbols[this->depth];
+            }
+
+            // Skips whole subtrees by their length in the table, so it costs
+            // O(depth * branching) whatever n is.
+            unsigned long long advance(unsigned long long n) override {
+                unsigned long long skipped = 0;
+                if (this->_has_next && n > 0) {
+                    this->_has_next = false;
+                    ++skipped;
+                }
+
+                while (skipped < n && !this->exhausted) {
+                    Symbol symbol = this->symbols[this->level];
+                    size_t &index = this->indices[this->level];
+                    if (index < this->d0l->successor_count(symbol)) {
+                        Symbol child = this->d0l->successors_begin(symbol)[index];
+                        ++index;
+
+                        unsigned long long length = this->d0l->length(child, this->depth - this->level - 1);
+                        if (length <= n - skipped) {
+                            skipped += length;
+                            continue;
+                        }
+
+                        ++this->level;
+                        this->symbols[this->level] = child;
+                        this->indices[this->level] = 0;
+                    } else if (this->level == 0) {
+                        this->exhausted = true;
+                    } else {
+                        --this->level;
+                    }
+                }
+                return skipped;
+            }
+
+        private:
+            const D0LSystem<TREENODE> *d0l;
+            vector<Symbol> symbols;
+            vector<size_t> indices;
+            unsigned int depth;
+            unsigned int level;
+            bool _has_next;
+            bool exhausted;
+
+            void check_next() {
+                if (this->_has_next || this->exhausted) {
+                    return;
+                }
+
+                while (true) {
+                    Symbol symbol = this->symbols[this->level];
+                    size_t &index = this->indices[this->level];
+                    if (index < this->d0l->successor_count(symbol)) {
+                        this->symbols[this->level + 1] = this->d0l->successors_begin(symbol)[index];
+                        ++index;
+
+                        if (this->level + 1 == this->depth) {
+                            this->_has_next = true;
+                            return;
+                        }
+
+                        ++this->level;
+                        this->indices[this->level] = 0;
+                    } else if (this->level == 0) {
+                        this->exhausted = true;
+                        return;
+                    } else {
+                        --this->level;
+                    }
+                }
+            }
+        };
+
+        template <typename TREENODE>
+        shared_ptr<Iterator<Symbol>> D0LSystem<TREENODE>::lazy_expand(Symbol symbol, unsigned int iterations) const {
+            return make_shared<D0LIterator<TREENODE>>(this, symbol, iterations);
+        }
+
+        // Yields the nodes a D0L expansion stands for, keeping the table alive.
+        template <typename TREENODE>
+        class D0LNodeIterator : public Iterator<TREENODE> {
+        public:
+            D0LNodeIterator(shared_ptr<D0LSystem<TREENODE>> d0l, Symbol symbol, unsigned int iterations)
+                : Iterator<TREENODE>(), d0l(d0l), symbols(d0l->lazy_expand(symbol, iterations)) {
+            }
+
+            bool has_next() override {
+                return this->symbols->has_next();
+            }
+
+            TREENODE &next() override {
+                this->current = this->d0l->node(this->symbols->next());
+                return this->current;
+            }
+
+            unsigned long long advance(unsigned long long n) override {
+                return this->symbols->advance(n);
+            }
+
+        private:
+            shared_ptr<D0LSystem<TREENODE>> d0l;
+            shared_ptr<Iterator<Symbol>> symbols;
+            TREENODE current;
+        };
+
+        // Lowers the nodes reachable from root into a D0L table. Fails, leaving
+        // result partially filled, if the materialiser isn't pure or more than
+        // max_states distinct nodes are reachable.
+        template <typename SYSTEM>
+        bool compile_d0l(SYSTEM &system, typename SYSTEM::TreeNode &root, size_t max_states,
+                         D0LSystem<typename SYSTEM::TreeNode> &result) {
+            using TreeNode = typename SYSTEM::TreeNode;
+            if (!system.has_pure_materialiser()) {
+                return false;
+            }
+
+            map<TreeNode, Symbol> symbols;
+            symbols[root] = result.add_node(root);
+
+            vector<TreeNode> expanded;
+            vector<Symbol> children;
+            for (Symbol next = 0; next < result.size(); ++next) {
+                TreeNode node = result.node(next);
+                expanded.clear();
+                children.clear();
+                system.expand(node, expanded);
+
+                for (auto child = expanded.begin(); child != expanded.end(); ++child) {
+                    auto known = symbols.find(*child);
+                    if (known != symbols.end()) {
+                        children.push_back(known->second);
+                        continue;
+                    }
+                    if (result.size() >= max_states) {
+                        return false;
+                    }
+                    Symbol symbol = result.add_node(*child);
+                    symbols[*child] = symbol;
+                    children.push_back(symbol);
+                }
+                result.add_successors(children);
+            }
+
+            return true;
+        }
+    }
+}
+
+#endif
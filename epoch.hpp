@@ -0,0 +1,142 @@
+#ifndef __MODAL_LSYSTEM_EPOCH__
+#define __MODAL_LSYSTEM_EPOCH__
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+namespace trlsai {
+    namespace lsystem {
+        // Epoch-based reclamation. Readers mark a slot with the global epoch
+        // while they hold a pointer to shared data, writers swap the data and
+        // retire the old copy, tagged with the epoch it was retired in. A
+        // retired object is released once every active slot has moved past
+        // its tag, so readers never see it freed and never take a lock.
+        class EpochDomain {
+        public:
+            static const size_t slot_count = 128;
+
+            EpochDomain(): epoch(1), overflow_next(slot_count) {
+                for (size_t j = 0; j < slot_count; ++j) {
+                    this->slots[j].epoch.store(0);
+                }
+            }
+
+            // Claims an idle slot at the current epoch and returns its index.
+            // Slots are probed from one picked by thread, so threads rarely
+            // share a cache line. With more readers at once than slots, the
+            // rest take an overflow entry under the lock rather than wait.
+            size_t enter() {
+                size_t start = hash<thread::id>()(this_thread::get_id()) % slot_count;
+                for (size_t j = 0; j < slot_count; ++j) {
+                    size_t index = (start + j) % slot_count;
+                    unsigned long long idle = 0;
+                    if (this->slots[index].epoch.compare_exchange_strong(idle, this->epoch.load())) {
+                        return index;
+                    }
+                }
+
+                lock_guard<mutex> lock(this->retired_lock);
+                size_t index = this->overflow_next++;
+                this->overflow[index] = this->epoch.load();
+                return index;
+            }
+
+            void exit(size_t slot) {
+                if (slot < slot_count) {
+                    this->slots[slot].epoch.store(0);
+                    return;
+                }
+                lock_guard<mutex> lock(this->retired_lock);
+                this->overflow.erase(slot);
+            }
+
+            // Keeps object alive until no reader can still hold it. The new
+            // version must already be published.
+            void retire(shared_ptr<const void> object) {
+                lock_guard<mutex> lock(this->retired_lock);
+                this->retired.push_back(make_pair(this->epoch.fetch_add(1), object));
+                this->reclaim_locked();
+            }
+
+            void reclaim() {
+                lock_guard<mutex> lock(this->retired_lock);
+                this->reclaim_locked();
+            }
+
+            // Retired objects not released yet.
+            size_t pending() {
+                lock_guard<mutex> lock(this->retired_lock);
+                return this->retired.size();
+            }
+
+        private:
+            struct Slot {
+                atomic<unsigned long long> epoch;
+                char padding[64 - sizeof(atomic<unsigned long long>)];
+            };
+
+            atomic<unsigned long long> epoch;
+            Slot slots[slot_count];
+            mutex retired_lock;
+            vector<pair<unsigned long long, shared_ptr<const void>>> retired;
+            // Readers that found every slot busy, guarded by retired_lock.
+            map<size_t, unsigned long long> overflow;
+            size_t overflow_next;
+
+            void reclaim_locked() {
+                unsigned long long oldest = this->epoch.load();
+                for (size_t j = 0; j < slot_count; ++j) {
+                    unsigned long long active = this->slots[j].epoch.load();
+                    if (active != 0 && active < oldest) {
+                        oldest = active;
+                    }
+                }
+                for (auto active = this->overflow.begin(); active != this->overflow.end(); ++active) {
+                    oldest = min(oldest, active->second);
+                }
+
+                size_t kept = 0;
+                for (size_t j = 0; j < this->retired.size(); ++j) {
+                    if (this->retired[j].first >= oldest) {
+                        this->retired[kept++] = this->retired[j];
+                    }
+                }
+                this->retired.resize(kept);
+            }
+        };
+
+        // Holds a slot of a domain for its lifetime. Does nothing without one.
+        class EpochGuard {
+        public:
+            EpochGuard(EpochDomain *domain): domain(domain), slot(domain == nullptr ? 0 : domain->enter()) { }
+
+            EpochGuard(EpochGuard &&other): domain(other.domain), slot(other.slot) {
+                other.domain = nullptr;
+            }
+
+            EpochGuard(const EpochGuard &) = delete;
+            EpochGuard &operator=(const EpochGuard &) = delete;
+
+            ~EpochGuard() {
+                if (this->domain != nullptr) {
+                    this->domain->exit(this->slot);
+                }
+            }
+
+        private:
+            EpochDomain *domain;
+            size_t slot;
+        };
+    }
+}
+
+#endif
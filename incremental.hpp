@@ -0,0 +1,163 @@
+#ifndef __MODAL_LSYSTEM_INCREMENTAL__
+#define __MODAL_LSYSTEM_INCREMENTAL__
+
+#include <chrono>
+#include <functional>
+#include <vector>
+
+using namespace std;
+
+namespace trlsai {
+    namespace lsystem {
+        // How much work a single step of an incremental job may do: a number
+        // of nodes, a duration, or both. Zero means no limit; a step always
+        // makes some progress, even with a budget of one node.
+        struct WorkBudget {
+            WorkBudget(unsigned long long nodes, chrono::nanoseconds time = chrono::nanoseconds::zero())
+                : nodes(nodes), time(time) { }
+
+            static WorkBudget of_time(chrono::nanoseconds time) {
+                return WorkBudget(0, time);
+            }
+
+            unsigned long long nodes;
+            chrono::nanoseconds time;
+        };
+
+        // Tracks a step against its budget. The clock is only read every few
+        // nodes, so time budgets can overrun by that much work.
+        class BudgetMeter {
+        public:
+            BudgetMeter(const WorkBudget &budget): budget(budget), used(0), checked(0) {
+                if (budget.time != chrono::nanoseconds::zero()) {
+                    this->deadline = chrono::steady_clock::now() + budget.time;
+                }
+            }
+
+            // Records work done and returns whether the budget is spent.
+            bool spend(unsigned long long nodes) {
+                this->used += nodes;
+                if (this->budget.nodes != 0 && this->used >= this->budget.nodes) {
+                    return true;
+                }
+                if (this->budget.time != chrono::nanoseconds::zero() && this->used - this->checked >= 64) {
+                    this->checked = this->used;
+                    return chrono::steady_clock::now() >= this->deadline;
+                }
+                return false;
+            }
+
+        private:
+            WorkBudget budget;
+            unsigned long long used;
+            unsigned long long checked;
+            chrono::steady_clock::time_point deadline;
+        };
+
+        // Resumable operation, run a step at a time so an event loop can
+        // interleave it with other work.
+        class IncrementalJob {
+        public:
+            virtual ~IncrementalJob() = default;
+
+            // Works until the budget is spent or the job is finished, and
+            // returns whether it's finished.
+            virtual bool step(const WorkBudget &budget) = 0;
+            virtual bool done() const = 0;
+
+            void run() {
+                while (!this->step(WorkBudget(0))) { }
+            }
+        };
+
+        // Eager expansion done a generation at a time, so it can stop after
+        // any node and resume there. It produces the same sequence as
+        // System::expand(node, iterations), holding two generations at most.
+        template <typename SYSTEM>
+        class ExpandJob : public IncrementalJob {
+        public:
+            using TreeNode = typename SYSTEM::TreeNode;
+
+            ExpandJob(SYSTEM *system, TreeNode &original, unsigned int iterations)
+                : system(system), current({ original }), level(0), iterations(iterations), index(0) {
+            }
+
+            bool step(const WorkBudget &budget) override {
+                BudgetMeter meter(budget);
+                while (!this->done()) {
+                    size_t before = this->next.size();
+                    this->system->expand(this->current[this->index], this->next);
+                    size_t produced = this->next.size() - before;
+                    ++this->index;
+                    if (this->index == this->current.size()) {
+                        this->next_level();
+                    }
+                    if (meter.spend(produced)) {
+                        break;
+                    }
+                }
+                return this->done();
+            }
+
+            // A generation that comes out empty stays empty.
+            bool done() const override {
+                return this->level >= this->iterations || this->current.empty();
+            }
+
+            // The expansion, once done.
+            vector<TreeNode> &result() {
+                return this->current;
+            }
+
+        private:
+            SYSTEM *system;
+            vector<TreeNode> current;
+            vector<TreeNode> next;
+            unsigned int level;
+            unsigned int iterations;
+            size_t index;
+
+            void next_level() {
+                this->current.swap(this->next);
+                this->next.clear();
+                this->index = 0;
+                ++this->level;
+            }
+        };
+
+        // Re-expands a list of registered nodes a few at a time; see
+        // System::update_all_job().
+        template <typename SYSTEM>
+        class RefreshJob : public IncrementalJob {
+        public:
+            using RegistrationNode = typename SYSTEM::RegistrationNode;
+
+            RefreshJob(vector<RegistrationNode> &&pending, function<unsigned long long(RegistrationNode&)> &&refresh)
+                : pending(pending), refresh(refresh), index(0) {
+            }
+
+            bool step(const WorkBudget &budget) override {
+                BudgetMeter meter(budget);
+                while (this->index < this->pending.size()) {
+                    unsigned long long nodes = this->refresh(this->pending[this->index]);
+                    ++this->index;
+                    if (meter.spend(nodes)) {
+                        break;
+                    }
+                }
+                return this->done();
+            }
+
+            bool done() const override {
+                return this->index >= this->pending.size();
+            }
+
+        private:
+            vector<RegistrationNode> pending;
+            function<unsigned long long(RegistrationNode&)> refresh;
+            size_t index;
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef __MODAL_LSYSTEM_INSTRUMENTATION__
+#define __MODAL_LSYSTEM_INSTRUMENTATION__
+
+// Counters are only updated when the build defines LSYSTEM_INSTRUMENTATION,
+// otherwise every LSYSTEM_COUNT expands to nothing and stats stay at zero.
+#ifdef LSYSTEM_INSTRUMENTATION
+#define LSYSTEM_COUNT(stats, counter, amount) ((stats).counter.fetch_add((amount), std::memory_order_relaxed))
+#else
+#define LSYSTEM_COUNT(stats, counter, amount) ((void) 0)
+#endif
+
+#include <atomic>
+
+namespace trlsai {
+    namespace lsystem {
+        // Values of the counters at some point; see SystemCounters.
+        struct SystemStats {
+            SystemStats() {
+                this->reset();
+            }
+
+            unsigned long long nodes_produced;
+            unsigned long long iterators_created;
+            unsigned long long iterators_destroyed;
+            unsigned long long registrations_added;
+            unsigned long long registrations_removed;
+            unsigned long long bytes_allocated;
+            unsigned long long rule_lookups;
+            unsigned long long materialiser_calls;
+            // Updates that copied the rules instead of editing them in place.
+            unsigned long long rule_copies;
+
+            void reset() {
+                this->nodes_produced = 0;
+                this->iterators_created = 0;
+                this->iterators_destroyed = 0;
+                this->registrations_added = 0;
+                this->registrations_removed = 0;
+                this->bytes_allocated = 0;
+                this->rule_lookups = 0;
+                this->materialiser_calls = 0;
+                this->rule_copies = 0;
+            }
+        };
+
+        // The counters themselves. Traversals on several threads and prefetch
+        // producers update them at once, so they're atomic; increments are
+        // relaxed, and snapshot() reads each counter on its own, so counters
+        // taken together are only consistent once the system is quiet.
+        struct SystemCounters {
+            SystemCounters() {
+                this->reset();
+            }
+
+            std::atomic<unsigned long long> nodes_produced;
+            std::atomic<unsigned long long> iterators_created;
+            std::atomic<unsigned long long> iterators_destroyed;
+            std::atomic<unsigned long long> registrations_added;
+            std::atomic<unsigned long long> registrations_removed;
+            std::atomic<unsigned long long> bytes_allocated;
+            std::atomic<unsigned long long> rule_lookups;
+            std::atomic<unsigned long long> materialiser_calls;
+            std::atomic<unsigned long long> rule_copies;
+
+            SystemStats snapshot() const {
+                SystemStats result;
+                result.nodes_produced = this->nodes_produced.load(std::memory_order_relaxed);
+                result.iterators_created = this->iterators_created.load(std::memory_order_relaxed);
+                result.iterators_destroyed = this->iterators_destroyed.load(std::memory_order_relaxed);
+                result.registrations_added = this->registrations_added.load(std::memory_order_relaxed);
+                result.registrations_removed = this->registrations_removed.load(std::memory_order_relaxed);
+                result.bytes_allocated = this->bytes_allocated.load(std::memory_order_relaxed);
+                result.rule_lookups = this->rule_lookups.load(std::memory_order_relaxed);
+                result.materialiser_calls = this->materialiser_calls.load(std::memory_order_relaxed);
+                result.rule_copies = this->rule_copies.load(std::memory_order_relaxed);
+                return result;
+            }
+
+            void reset() {
+                this->nodes_produced.store(0);
+                this->iterators_created.store(0);
+                this->iterators_destroyed.store(0);
+                this->registrations_added.store(0);
+                this->registrations_removed.store(0);
+                this->bytes_allocated.store(0);
+                this->rule_lookups.store(0);
+                this->materialiser_calls.store(0);
+                this->rule_copies.store(0);
+            }
+        };
+
+        inline constexpr bool instrumentation_enabled() {
+#ifdef LSYSTEM_INSTRUMENTATION
+            return true;
+#else
+            return false;
+#endif
+        }
+    }
+}
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef __MODAL_LSYSTEM_LAZY_ITERATOR__
 #define __MODAL_LSYSTEM_LAZY_ITERATOR__
 
+#include <atomic>
 #include <vector>
 #include <memory>
 #include <map>
@@ -10,19 +11,90 @@ using namespace std;
 
 namespace trlsai {
     namespace lsystem {
+        template <typename T>
+        class IteratorRegistry;
+
         template <typename T>
         class Iterator {
         public:
-            Iterator(vector<T> &series): series(series) { }            
+            Iterator(): mailbox(nullptr) { }
+            Iterator(vector<T> &series): series(series), mailbox(nullptr) { }            
+
+            virtual ~Iterator() {
+                delete this->mailbox.load();
+            }
+
             virtual bool has_next() = 0;
             virtual T &next() = 0;
 
+            // Skips up to n elements and returns how many were skipped, which is
+            // less than n only when the iterator runs out.
+            virtual unsigned long long advance(unsigned long long n) {
+                unsigned long long skipped = 0;
+                while (skipped < n && this->has_next()) {
+                    this->next();
+                    ++skipped;
+                }
+                return skipped;
+            }
+
             void update_series(vector<T> &series) {
                 this->series = series;
             }
+
+            // Hands a new series to an iterator another thread is driving. It
+            // replaces the current one at the iterator's next has_next() or
+            // advance(), or is itself replaced by a later post.
+            void post_series(vector<T> &series) {
+                delete this->mailbox.exchange(new vector<T>(series));
+            }
+
+            // Has the iterator bring its series, the expansion of node, up to
+            // date itself whenever updates moves on from seen, the version the
+            // series was expanded at; see IteratorRegistry::reconcile().
+            void subscribe(IteratorRegistry<T> *registry, T &node, const atomic<unsigned long> *updates, unsigned long seen) {
+                this->subscription.reset(new Subscription{ registry, node, updates, seen, seen });
+            }
             
         protected:
             vector<T> series;
+
+            void sync_series() {
+                if (this->subscription != nullptr) {
+                    this->reconcile();
+                }
+                if (this->mailbox.load(memory_order_relaxed) == nullptr) {
+                    return;
+                }
+                vector<T> *posted = this->mailbox.exchange(nullptr);
+                if (posted != nullptr) {
+                    this->series = move(*posted);
+                    delete posted;
+                }
+            }
+
+        private:
+            struct Subscription {
+                IteratorRegistry<T> *registry;
+                T node;
+                const atomic<unsigned long> *updates;
+                // Value of updates when last looked at, and the version the
+                // series was expanded at.
+                unsigned long checked;
+                unsigned long seen;
+            };
+
+            atomic<vector<T> *> mailbox;
+            unique_ptr<Subscription> subscription;
+
+            void reconcile() {
+                Subscription &subscription = *this->subscription;
+                unsigned long updates = subscription.updates->load(memory_order_relaxed);
+                if (updates != subscription.checked) {
+                    subscription.checked = updates;
+                    subscription.registry->reconcile(subscription.node, subscription.seen, this->series);
+                }
+            }
         };
 
         template <typename T>
@@ -30,6 +102,13 @@ namespace trlsai {
         public:
             virtual void register_it(T &key, shared_ptr<Iterator<T>> it) = 0;
             virtual void unregister_it(T &key, shared_ptr<Iterator<T>> it) = 0;
+
+            // Called by subscribed iterators when updates were made since they
+            // last checked: re-expands node into series if the updates affect
+            // it, moving seen on, and returns whether it did.
+            virtual bool reconcile(T &, unsigned long &, vector<T> &) {
+                return false;
+            }
         };
 
         template <typename T>
@@ -38,6 +117,7 @@ namespace trlsai {
             VectorIterator(vector<T> &series): Iterator<T>(series), index(0) { }
     
             bool has_next() override {
+                this->sync_series();
                 return this->index < this->series.size();
             }
 
@@ -46,28 +126,182 @@ namespace trlsai {
                 ++index;
                 return retval;        
             }
+
+            unsigned long long advance(unsigned long long n) override {
+                this->sync_series();
+                size_t remaining = this->index < this->series.size() ? this->series.size() - this->index : 0;
+                size_t skipped = n < remaining ? static_cast<size_t>(n) : remaining;
+                this->index += skipped;
+                return skipped;
+            }
     
         private:
             size_t index;
         };
 
+        // Yields at most count elements of another iterator.
+        template <typename T>
+        class LimitedIterator : public Iterator<T> {
+        public:
+            LimitedIterator(shared_ptr<Iterator<T>> inner, unsigned long long count)
+                : Iterator<T>(), inner(inner), remaining(count) { }
+
+            bool has_next() override {
+                return this->remaining > 0 && this->inner->has_next();
+            }
+
+            T &next() override {
+                --this->remaining;
+                return this->inner->next();
+            }
+
+            unsigned long long advance(unsigned long long n) override {
+                unsigned long long skipped = this->inner->advance(n < this->remaining ? n : this->remaining);
+                this->remaining -= skipped;
+                return skipped;
+            }
+
+        private:
+            shared_ptr<Iterator<T>> inner;
+            unsigned long long remaining;
+        };
+
+        // Expands the bottom levels of a subtree in a single loop. The series
+        // holds the first level, and each deeper level keeps one buffer that is
+        // reused for every node expanded at that level, so no iterators are
+        // created below this one. When given, length(node, levels) is the size
+        // of the subtree that many levels below the node, and lets advance()
+        // step over subtrees without expanding them.
+        template <typename T>
+        class FusedLazyIterator : public Iterator<T> {
+        public:
+            FusedLazyIterator(function<void(T&, vector<T>&)> &&expander,
+                              vector<T> &series, unsigned int depth,
+                              function<unsigned long long(T&, unsigned int)> &&length = nullptr)
+                : Iterator<T>(series), expander(expander), length(length), levels(depth), indices(depth, 0),
+                  top(0), _has_next(false) {
+            }
+
+            bool has_next() override {
+                this->sync_series();
+                this->check_next();
+                return this->_has_next;
+            }
+
+            T &next() override {
+                this->check_next();
+                this->_has_next = false;
+                return this->level(this->top)[this->indices[this->top]++];
+            }
+
+            unsigned long long advance(unsigned long long n) override {
+                this->sync_series();
+                this->_has_next = false;
+                unsigned long long skipped = 0;
+                size_t leaves = this->levels.size() - 1;
+                while (skipped < n) {
+                    vector<T> &current = this->level(this->top);
+                    size_t &index = this->indices[this->top];
+                    if (index >= current.size()) {
+                        if (this->top == 0) {
+                            break;
+                        }
+                        --this->top;
+                        continue;
+                    }
+
+                    if (this->top == leaves) {
+                        size_t available = current.size() - index;
+                        size_t taken = n - skipped < available ? static_cast<size_t>(n - skipped) : available;
+                        index += taken;
+                        skipped += taken;
+                        continue;
+                    }
+
+                    T &node = current[index];
+                    if (this->length) {
+                        unsigned long long subtree = this->length(node, static_cast<unsigned int>(leaves - this->top));
+                        if (subtree <= n - skipped) {
+                            skipped += subtree;
+                            ++index;
+                            continue;
+                        }
+                    }
+
+                    ++index;
+                    ++this->top;
+                    this->levels[this->top].clear();
+                    this->indices[this->top] = 0;
+                    this->expander(node, this->levels[this->top]);
+                }
+                return skipped;
+            }
+
+        private:
+            function<void(T&, vector<T>&)> expander;
+            function<unsigned long long(T&, unsigned int)> length;
+            vector<vector<T>> levels;
+            vector<size_t> indices;
+            size_t top;
+            bool _has_next;
+
+            vector<T> &level(size_t depth) {
+                return depth == 0 ? this->series : this->levels[depth];
+            }
+
+            void check_next() {
+                if (this->_has_next) {
+                    return;
+                }
+
+                size_t leaves = this->levels.size() - 1;
+                while (true) {
+                    vector<T> &current = this->level(this->top);
+                    if (this->indices[this->top] >= current.size()) {
+                        if (this->top == 0) {
+                            break;
+                        }
+                        --this->top;
+                        continue;
+                    }
+
+                    if (this->top == leaves) {
+                        this->_has_next = true;
+                        break;
+                    }
+
+                    T &node = current[this->indices[this->top]];
+                    ++this->indices[this->top];
+                    ++this->top;
+                    this->levels[this->top].clear();
+                    this->indices[this->top] = 0;
+                    this->expander(node, this->levels[this->top]);
+                }
+            }
+        };
+
         template <typename T>
         struct IteratorRegistration {
             T key;
             shared_ptr<Iterator<T>> iterator;
         };
         
+        // When given, child_length(node) is the number of elements the iterator
+        // iter_gen would create for the node yields, and lets advance() step
+        // over whole children without creating them.
         template <typename T>
         class NestedLazyIterator : public Iterator<T> {
         public:
             NestedLazyIterator(IteratorRegistry<T> *registry,
                                function<shared_ptr<Iterator<T>>(T&)> &&iter_gen,
-                               vector<T> &series)
-                : Iterator<T>(series), registry(registry), iter_gen(iter_gen),
+                               vector<T> &series,
+                               function<unsigned long long(T&)> &&child_length = nullptr)
+                : Iterator<T>(series), registry(registry), iter_gen(iter_gen), child_length(child_length),
                   series_index(0), current_it({ T(), nullptr }), _has_next(false) {
             }
 
             bool has_next() override {
+                this->sync_series();
                 this->check_next();
                 return this->_has_next;
             }
@@ -77,10 +311,47 @@ namespace trlsai {
                 this->_has_next = false;
                 return this->current_it.iterator->next();
             }
+
+            unsigned long long advance(unsigned long long n) override {
+                this->sync_series();
+                this->_has_next = false;
+                unsigned long long skipped = 0;
+                while (skipped < n) {
+                    if (this->current_it.iterator != nullptr) {
+                        skipped += this->current_it.iterator->advance(n - skipped);
+                        if (skipped == n) {
+                            break;
+                        }
+                        this->unregister_it();
+                        this->current_it.iterator = nullptr;
+                    }
+
+                    if (this->series_index >= this->series.size()) {
+                        break;
+                    }
+
+                    T &series_key = this->series[this->series_index];
+                    if (this->child_length) {
+                        unsigned long long length = this->child_length(series_key);
+                        if (length <= n - skipped) {
+                            skipped += length;
+                            ++this->series_index;
+                            continue;
+                        }
+                    }
+
+                    this->current_it.iterator = this->iter_gen(series_key);
+                    this->current_it.key = series_key;
+                    this->register_it();
+                    ++this->series_index;
+                }
+                return skipped;
+            }
     
         private:
             IteratorRegistry<T> *registry;
             function<shared_ptr<Iterator<T>>(T&)> iter_gen;
+            function<unsigned long long(T&)> child_length;
             size_t series_index;
             IteratorRegistration<T> current_it;
             bool _has_next;
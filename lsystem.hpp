@@ -1,11 +1,29 @@
 #ifndef __MODAL_LSYSTEM_LSYSTEM__
 #define __MODAL_LSYSTEM_LSYSTEM__
 
+#include <atomic>
+#include <functional>
 #include <vector>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
 #include <iostream>
 #include "lazy_iterator.hpp"
+#include "instrumentation.hpp"
+#include "epoch.hpp"
+#include "bounded_iterator.hpp"
+#include "d0l.hpp"
+#include "rule_analysis.hpp"
+#include "planner.hpp"
+#include "reduction.hpp"
+#include "timeline.hpp"
+#include "snapshot.hpp"
+#include "prefetch_iterator.hpp"
+#include "realtime.hpp"
+#include "incremental.hpp"
+#include "tee_iterator.hpp"
 
 using namespace std;
 
@@ -22,6 +40,10 @@ namespace trlsai {
         struct empty {
         };
 
+        inline bool operator<(const empty &, const empty &) {
+            return false;
+        }
+
         template <typename KEY>
         struct RuleNode<KEY, empty> {
             RuleNode() = default;
@@ -30,6 +52,32 @@ namespace trlsai {
             empty ruledata;
         };
 
+        // Hashes the parts of a rule set System::rules_fingerprint() combines.
+        // std::hash is only stable within a build of the standard library, so
+        // checkpoints meant to outlive one need a hasher of their own with the
+        // same two methods.
+        template <typename KEY, typename RULEDATA>
+        struct RulesHasher {
+            unsigned long long key(const KEY &key) const {
+                return hash<KEY>()(key);
+            }
+
+            unsigned long long rule_data(const RULEDATA &data) const {
+                return hash<RULEDATA>()(data);
+            }
+        };
+
+        template <typename KEY>
+        struct RulesHasher<KEY, empty> {
+            unsigned long long key(const KEY &key) const {
+                return hash<KEY>()(key);
+            }
+
+            unsigned long long rule_data(const empty &) const {
+                return 0;
+            }
+        };
+
         template <typename KEY, typename RULEDATA, typename VALUE>
         struct Triplet : public RuleNode<KEY, RULEDATA> {
             Triplet() = default;
@@ -44,6 +92,25 @@ namespace trlsai {
             VALUE value;
         };
 
+        // Orders nodes by key, rule data and value, so they can be used as
+        // states in maps.
+        template <typename KEY, typename RULEDATA, typename VALUE>
+        bool operator<(const Triplet<KEY, RULEDATA, VALUE> &left, const Triplet<KEY, RULEDATA, VALUE> &right) {
+            if (left.key < right.key) {
+                return true;
+            }
+            if (right.key < left.key) {
+                return false;
+            }
+            if (left.ruledata < right.ruledata) {
+                return true;
+            }
+            if (right.ruledata < left.ruledata) {
+                return false;
+            }
+            return left.value < right.value;
+        }
+
         template <typename FIRST, typename SECOND>
         struct Pair {
             Pair(FIRST first, SECOND second): first(first), second(second) { }
@@ -55,6 +122,46 @@ namespace trlsai {
         class Materialiser {
         public:
             virtual Triplet<KEY, RULEDATA, VALUE> produce(const KEY &key, const RULEDATA &rule_data, const Triplet<KEY, RULEDATA, VALUE> &parent, unsigned int total_siblings) = 0;
+
+            // Whether produce() depends only on its arguments, at least until
+            // the next System::update_all(). Pure materialisers allow results
+            // to be cached and systems to be compiled to D0L tables.
+            virtual bool is_pure() {
+                return false;
+            }
+        };
+
+        // Whether a lazy traversal follows rule updates made while it runs, or
+        // expands against the rules current when it started.
+        enum class Isolation { LIVE, SNAPSHOT };
+
+        // What a traversal does with the subtree below an internal node.
+        enum class Descent { DESCEND, SKIP, STOP };
+
+        // Default callbacks for System::traverse. Visitors derive from it and
+        // hide the ones they need: enter() is called for every internal node
+        // with the number of levels left below it, visit() for every node of
+        // the requested generation, and skip() with the length of every
+        // subtree enter() chose to skip.
+        template <typename TREENODE>
+        struct TraversalVisitor {
+            Descent enter(TREENODE &, unsigned int) {
+                return Descent::DESCEND;
+            }
+
+            bool visit(TREENODE &) {
+                return true;
+            }
+
+            void skip(TREENODE &, unsigned int, unsigned long long) {
+            }
+        };
+
+        // Number of times each key and each value occurs in a generation.
+        template <typename KEY, typename VALUE>
+        struct Histogram {
+            map<KEY, unsigned long long> keys;
+            map<VALUE, unsigned long long> values;
         };
 
         template <typename T>
@@ -74,37 +181,140 @@ namespace trlsai {
         template <typename KEY, typename RULEDATA, typename VALUE>
         class System final : public IteratorRegistry<Triplet<KEY, RULEDATA, VALUE>> {
         public:
+            using Key = KEY;
             using TreeNode = Triplet<KEY, RULEDATA, VALUE>;
-            using Rules = map<KEY, vector<RuleNode<KEY, RULEDATA>>>;
-            using RegistrationNode = Pair<TreeNode, shared_ptr<Iterator<TreeNode>>>;
+            using RuleList = vector<RuleNode<KEY, RULEDATA>>;
+            using Rules = map<KEY, RuleList>;
+            // Registrations don't keep iterators alive: once the last owner of
+            // an iterator drops it, its registration is swept by the next
+            // refresh or compaction of its key.
+            using RegistrationNode = Pair<TreeNode, weak_ptr<Iterator<TreeNode>>>;
     
             System(shared_ptr<Rules> rules, shared_ptr<Materialiser<KEY, RULEDATA, VALUE>> materialiser):
-                rules(rules), materialiser(materialiser) {
+                rules(rules), published(rules.get()), materialiser(materialiser), leaf_fusion_depth(1), version(0),
+                statistics(make_shared<SystemCounters>()), deferred(false), all_updated(0) {
+                this->registrations.push_back(unique_ptr<RegistrationShard>(new RegistrationShard()));
             }
 
-            void update_all() {
-                for (auto registration = this->registrations.begin(); registration != this->registrations.end(); ++registration) {
-                    for (auto it = registration->second.begin(); it != registration->second.end(); ++it) {
-                        RegistrationNode &element = *it;
-                        vector<TreeNode> expanded;
-                        this->expand(element.first, expanded);
-                        element.second->update_series(expanded);
-                    }   
+            // Lets several threads run their own lazy_expand(), generate() or
+            // expand() traversals while others update the rules. Must be called
+            // before the system is shared.
+            //
+            // Rule lookups take no lock: updates copy the rules, publish the
+            // copy with an atomic pointer swap and retire the old one through an
+            // EpochDomain, so readers only mark an epoch slot while they look a
+            // rule up. Updates are serialised among themselves, and from then on
+            // replace the rules the system was built with instead of editing
+            // them. Registrations are split in shards picked by thread, and
+            // iterators receive re-expanded series through post_series(), so an
+            // update never touches an iterator another thread is inside.
+            //
+            // Rule pointers from find_rule() are only valid while a read_guard()
+            // is held. The system's own traversals and analyses hold one for as
+            // long as they run, so only code calling find_rule() directly needs
+            // to take it. Iterators that keep rule pointers between calls hold
+            // the rules they took them from instead; see find_rule(key, holder).
+            void enable_concurrency(size_t shards = 16) {
+                if (this->epochs != nullptr) {
+                    return;
+                }
+                this->epochs = make_shared<EpochDomain>();
+                while (this->registrations.size() < shards) {
+                    this->registrations.push_back(unique_ptr<RegistrationShard>(new RegistrationShard()));
                 }
             }
 
-            void update_rule(const KEY &key, const vector<RuleNode<KEY, RULEDATA>> &value) {
-                (*this->rules)[key] = value;
+            bool concurrent() const {
+                return this->epochs != nullptr;
+            }
+
+            // Keeps the rules current at the time of the call alive until it's
+            // destroyed. Does nothing unless concurrency is enabled.
+            EpochGuard read_guard() {
+                return EpochGuard(this->epochs.get());
+            }
+
+            // Counters for the allocations and lookups done by this system.
+            // They stay at zero unless LSYSTEM_INSTRUMENTATION is defined.
+            SystemStats stats() const {
+                return this->statistics->snapshot();
+            }
+
+            void reset_stats() {
+                this->statistics->reset();
+            }
+
+            // Number of bottom levels of a lazy expansion produced by a single
+            // FusedLazyIterator instead of a chain of nested iterators. Nodes
+            // inside a fused subtree are not registered, so rule updates only
+            // reach the ones that haven't been expanded yet.
+            void set_leaf_fusion_depth(unsigned int depth) {
+                this->leaf_fusion_depth = depth < 1 ? 1 : depth;
+            }
 
-                auto registration = this->registrations.find(key);
-                if (registration == this->registrations.end()) {
+            // With deferred updates, rule updates only record which keys changed,
+            // and registered iterators re-expand their own series the next time
+            // they're advanced, if their key changed since they last did. The
+            // cost of an update is then paid incrementally, and only by
+            // iterators that continue. Iterators don't join the registry at
+            // all. Set it before starting lazy traversals.
+            void set_deferred_updates(bool deferred) {
+                this->deferred = deferred;
+            }
+
+            void update_all() {
+                auto writing = this->lock(this->writer);
+                if (this->deferred) {
+                    this->record_update(nullptr);
+                    this->clear_caches();
                     return;
                 }
-                for (auto it = registration->second.begin(); it != registration->second.end(); ++it) {
-                    RegistrationNode &element = *it;
-                    vector<TreeNode> expanded;
-                    this->expand(element.first, expanded);
-                    element.second->update_series(expanded);
+                this->clear_caches();
+                for (auto shard = this->registrations.begin(); shard != this->registrations.end(); ++shard) {
+                    auto locked = this->lock((*shard)->lock);
+                    for (auto registration = (*shard)->entries.begin(); registration != (*shard)->entries.end(); ++registration) {
+                        this->refresh(registration->second);
+                    }
+                }
+            }
+
+            // update_all() as a job that re-expands registrations a budget at a
+            // time. Caches are cleared straight away, so new traversals see the
+            // change at once, while iterators registered before the call keep
+            // their old series until the job reaches them.
+            shared_ptr<IncrementalJob> update_all_job() {
+                auto writing = this->lock(this->writer);
+                if (this->deferred) {
+                    this->record_update(nullptr);
+                }
+                this->clear_caches();
+
+                vector<RegistrationNode> pending;
+                for (auto shard = this->registrations.begin(); shard != this->registrations.end(); ++shard) {
+                    auto locked = this->lock((*shard)->lock);
+                    for (auto registration = (*shard)->entries.begin(); registration != (*shard)->entries.end(); ++registration) {
+                        this->compact(registration->second);
+                        pending.insert(pending.end(), registration->second.begin(), registration->second.end());
+                    }
+                }
+
+                return make_shared<RefreshJob<System>>(move(pending), [this](RegistrationNode &element) {
+                    auto writing = this->lock(this->writer);
+                    return this->refresh(element);
+                });
+            }
+
+            void update_rule(const KEY &key, const vector<RuleNode<KEY, RULEDATA>> &value) {
+                auto writing = this->lock(this->writer);
+                shared_ptr<Rules> updated = this->writable_rules();
+                (*updated)[key] = value;
+                this->publish(updated);
+                if (this->deferred) {
+                    this->record_update(&key);
+                    this->clear_caches();
+                } else {
+                    this->clear_caches();
+                    this->refresh(key);
                 }
             }
             
@@ -112,57 +322,535 @@ namespace trlsai {
                 this->update_rule(key, value);
             }
 
+            // Replaces the rules of every key in the batch at once. Caches are
+            // cleared a single time and each affected registration is
+            // re-expanded once, against the final rules, so bulk edits cost one
+            // pass instead of one per key.
+            void update_rules(const Rules &batch) {
+                auto writing = this->lock(this->writer);
+                shared_ptr<Rules> updated = this->writable_rules();
+                for (auto rule = batch.begin(); rule != batch.end(); ++rule) {
+                    (*updated)[rule->first] = rule->second;
+                }
+                this->publish(updated);
+
+                if (this->deferred) {
+                    for (auto rule = batch.begin(); rule != batch.end(); ++rule) {
+                        this->record_update(&rule->first);
+                    }
+                    this->clear_caches();
+                    return;
+                }
+                this->clear_caches();
+                for (auto rule = batch.begin(); rule != batch.end(); ++rule) {
+                    this->refresh(rule->first);
+                }
+            }
+
             void register_it(TreeNode &key, shared_ptr<Iterator<TreeNode>> it) override {
-                auto iter = this->registrations.find(key.key);
-                if (iter == this->registrations.end()) {
-                    this->registrations[key.key] = vector<RegistrationNode>({ RegistrationNode(key, it) });
+                if (this->deferred) {
+                    // Another thread may have updated the rules since the series
+                    // was expanded, so it's taken to be a version older.
+                    unsigned long seen = this->version;
+                    it->subscribe(this, key, &this->version, this->epochs != nullptr && seen > 0 ? seen - 1 : seen);
+                    return;
+                }
+
+                LSYSTEM_COUNT(*this->statistics, registrations_added, 1);
+                RegistrationShard &shard = this->local_shard();
+                auto locked = this->lock(shard.lock);
+                auto iter = shard.entries.find(key.key);
+                if (iter == shard.entries.end()) {
+                    shard.entries[key.key] = vector<RegistrationNode>({ RegistrationNode(key, it) });
                 } else {
+                    // Sweeping before the vector would grow keeps it within twice
+                    // the live registrations, at amortised constant cost.
+                    if (iter->second.size() == iter->second.capacity()) {
+                        this->compact(iter->second);
+                    }
                     iter->second.push_back(RegistrationNode(key, it));
                 }
             }
 
             void unregister_it(TreeNode &key, shared_ptr<Iterator<TreeNode>> it) override {
-                auto iter = this->registrations.find(key.key);
-                if (iter == this->registrations.end()) {
+                // Iterators are normally unregistered by the thread that
+                // registered them, so their own shard is searched first.
+                RegistrationShard &local = this->local_shard();
+                if (this->unregister_it(local, key, it)) {
                     return;
                 }
+                for (auto shard = this->registrations.begin(); shard != this->registrations.end(); ++shard) {
+                    if (shard->get() != &local && this->unregister_it(**shard, key, it)) {
+                        return;
+                    }
+                }
+            }
 
-                vector<RegistrationNode> &elements = iter->second;
-                int size = static_cast<int>(elements.size());
-                for (int j = size - 1; j >= 0; --j) {
-                    if (elements[static_cast<size_t>(j)].second == it) {
-                        elements.erase(elements.begin() + j);
-                        break;
+            bool reconcile(TreeNode &node, unsigned long &seen, vector<TreeNode> &series) override {
+                unsigned long current = this->version;
+                {
+                    auto locked = this->lock(this->updates_lock);
+                    unsigned long changed = this->all_updated;
+                    auto updated = this->key_updates.find(node.key);
+                    if (updated != this->key_updates.end() && updated->second > changed) {
+                        changed = updated->second;
+                    }
+                    if (changed <= seen) {
+                        return false;
+                    }
+                }
+
+                series.clear();
+                this->expand(node, series);
+                seen = current;
+                return true;
+            }
+
+            // Drops the registrations of every iterator that's no longer alive,
+            // and keys left without any. Rule updates do this for the keys they
+            // touch; long-running callers can also call it periodically.
+            void compact_registrations() {
+                for (auto shard = this->registrations.begin(); shard != this->registrations.end(); ++shard) {
+                    auto locked = this->lock((*shard)->lock);
+                    auto &entries = (*shard)->entries;
+                    for (auto registration = entries.begin(); registration != entries.end(); ) {
+                        this->compact(registration->second);
+                        if (registration->second.empty()) {
+                            registration = entries.erase(registration);
+                        } else {
+                            ++registration;
+                        }
+                    }
+                }
+            }
+
+            // Number of registrations held, including those of iterators that
+            // died since their key was last compacted.
+            size_t registration_count() {
+                size_t count = 0;
+                for (auto shard = this->registrations.begin(); shard != this->registrations.end(); ++shard) {
+                    auto locked = this->lock((*shard)->lock);
+                    for (auto registration = (*shard)->entries.begin(); registration != (*shard)->entries.end(); ++registration) {
+                        count += registration->second.size();
                     }
                 }
+                return count;
             }
 
             void expand(TreeNode &original, vector<TreeNode> &result) {
-                auto iter = this->rules->find(original.key);
-                if (iter == this->rules->end()) {
+                size_t capacity = result.capacity();
+                EpochGuard guard(this->epochs.get());
+                const Rules *rules = this->published.load();
+                LSYSTEM_COUNT(*this->statistics, rule_lookups, 1);
+                auto iter = rules->find(original.key);
+                if (iter == rules->end()) {
+                    LSYSTEM_COUNT(*this->statistics, materialiser_calls, 1);
                     result.push_back(this->materialiser->produce(original.key, original.ruledata, original, 1));
                 } else {
                     unsigned int total_siblings = static_cast<unsigned int>(iter->second.size());
+                    LSYSTEM_COUNT(*this->statistics, materialiser_calls, total_siblings);
                     for (auto keyit = iter->second.begin(); keyit != iter->second.end(); ++keyit) {
                         TreeNode element = this->materialiser->produce(keyit->key, keyit->ruledata, original, total_siblings);
                         result.push_back(element);
                     }
                 }
+                this->count_nodes(capacity, result);
+            }
+
+            // Rule the node with the given key expands with, or nullptr when it
+            // has none and expands to a single copy of itself.
+            const RuleList *find_rule(const KEY &key) {
+                LSYSTEM_COUNT(*this->statistics, rule_lookups, 1);
+                const Rules *rules = this->published.load();
+                auto iter = rules->find(key);
+                return iter == rules->end() ? nullptr : &iter->second;
+            }
+
+            // Like find_rule(key), for readers that keep the result between
+            // calls: in concurrent mode holder is pointed at the rules the
+            // result comes from, keeping them alive. That only locks when the
+            // rules changed since holder was last set.
+            const RuleList *find_rule(const KEY &key, shared_ptr<const Rules> &holder) {
+                LSYSTEM_COUNT(*this->statistics, rule_lookups, 1);
+                const Rules *rules = this->published.load();
+                if (this->epochs != nullptr && holder.get() != rules) {
+                    auto reading = this->lock(this->rules_lock);
+                    holder = this->rules;
+                    rules = holder.get();
+                }
+                auto iter = rules->find(key);
+                return iter == rules->end() ? nullptr : &iter->second;
+            }
+
+            // Changes whenever the rules change or update_all() runs, so
+            // anything derived from them can tell when it's stale.
+            unsigned long rules_version() const {
+                return this->version;
+            }
+
+            bool has_pure_materialiser() {
+                return this->materialiser->is_pure();
+            }
+
+            // Largest number of children any node can have under the current rules.
+            size_t max_branching() {
+                EpochGuard guard(this->epochs.get());
+                const Rules *rules = this->published.load();
+                size_t branching = 1;
+                for (auto rule = rules->begin(); rule != rules->end(); ++rule) {
+                    branching = max(branching, rule->second.size());
+                }
+                return branching;
+            }
+
+            static size_t child_count(const RuleList *rule) {
+                return rule == nullptr ? 1 : rule->size();
+            }
+
+            // Child at the given index of a node expanding with the given rule.
+            TreeNode produce_child(TreeNode &parent, const RuleList *rule, size_t index) {
+                LSYSTEM_COUNT(*this->statistics, materialiser_calls, 1);
+                if (rule == nullptr) {
+                    return this->materialiser->produce(parent.key, parent.ruledata, parent, 1);
+                }
+                const RuleNode<KEY, RULEDATA> &rule_node = (*rule)[index];
+                return this->materialiser->produce(rule_node.key, rule_node.ruledata, parent, static_cast<unsigned int>(rule->size()));
+            }
+
+            // The current rules, frozen: updates made while the result is alive
+            // leave it untouched and work on a copy instead. Pinning itself
+            // only shares the rules, so it costs the same whatever their size.
+            shared_ptr<const Rules> pin_rules() {
+                auto writing = this->lock(this->writer);
+                this->pinned = this->rules;
+                return this->rules;
+            }
+
+            shared_ptr<RuleSnapshot<System>> snapshot() {
+                return make_shared<RuleSnapshot<System>>(this, this->pin_rules());
+            }
+
+            // Snapshot traversals expand against pinned rules with a bounded
+            // iterator and skip the registry altogether; live ones are
+            // registered and pick up updates to nodes they haven't expanded.
+            shared_ptr<Iterator<TreeNode>> lazy_expand(TreeNode &original, unsigned int iterations, Isolation isolation) {
+                if (isolation == Isolation::SNAPSHOT) {
+                    return this->make_iterator<SnapshotIterator<System>>(this->snapshot(), original, iterations);
+                }
+                return this->lazy_expand(original, iterations);
+            }
+
+            // Snapshot traversal run ahead of the consumer on a producer
+            // thread; see PrefetchIterator. The producer calls the materialiser,
+            // which has to tolerate being used from that thread.
+            shared_ptr<Iterator<TreeNode>> prefetch_expand(TreeNode &original, unsigned int iterations, size_t lookahead = 4096) {
+                return this->make_iterator<PrefetchIterator<TreeNode>>(this->lazy_expand(original, iterations, Isolation::SNAPSHOT),
+                                                                       lookahead);
+            }
+
+            // One expansion read by several consumers; see TeeBuffer. Threaded
+            // tees pull the traversal from whichever consumer's thread needs
+            // more, so they expand a snapshot. Single-thread ones expand live,
+            // and updates only reach elements that aren't buffered yet.
+            vector<shared_ptr<Iterator<TreeNode>>> tee_expand(TreeNode &original, unsigned int iterations, size_t consumers,
+                                                              TeeMode mode = TeeMode::SINGLE_THREAD,
+                                                              size_t chunk_size = 1024, size_t max_chunks = 16) {
+                Isolation isolation = mode == TeeMode::MULTI_THREAD ? Isolation::SNAPSHOT : Isolation::LIVE;
+                auto buffer = make_shared<TeeBuffer<TreeNode>>(this->lazy_expand(original, iterations, isolation),
+                                                               consumers, mode, chunk_size, max_chunks);
+                vector<shared_ptr<Iterator<TreeNode>>> result;
+                for (size_t j = 0; j < consumers; ++j) {
+                    result.push_back(this->make_iterator<TeeIterator<TreeNode>>(buffer, j));
+                }
+                return result;
+            }
+
+            // Traversal for real-time threads, with storage for any depth up to
+            // max_depth allocated here; see RealtimeIterator. Build it off the
+            // real-time thread and reseed() it there.
+            shared_ptr<RealtimeIterator<System>> realtime_expand(TreeNode &original, unsigned int max_depth) {
+                return static_pointer_cast<RealtimeIterator<System>>(
+                    this->make_iterator<RealtimeIterator<System>>(this->snapshot(), original, max_depth));
             }
 
             shared_ptr<Iterator<TreeNode>> lazy_expand(TreeNode &original, unsigned int iterations) {
-                auto ctx = make_shared<Context<TreeNode>>(original);
-                ctx->iterations = iterations;
+                return this->fused_lazy_expand(original, iterations, this->leaf_fusion_depth);
+            }
 
-                auto retval = this->ltree(ctx);
-                this->register_it(original, retval);
-                // TODO: this one doesn't get unregistered, it's probably better to let
-                // iterators register and unregister themselves when they reach the end.
-                return retval;
+            // Traverses the whole expansion from a single iterator that keeps one
+            // reusable buffer per level and resumes where the previous next()
+            // stopped, instead of a chain of nested iterators. Memory is bounded
+            // by iterations times the widest rule. The iterator isn't registered,
+            // so rule updates only affect nodes it hasn't expanded yet.
+            shared_ptr<Iterator<TreeNode>> generate(TreeNode &original, unsigned int iterations) {
+                vector<TreeNode> series;
+                if (iterations == 0) {
+                    series.push_back(original);
+                } else {
+                    this->expand(original, series);
+                }
+
+                return this->make_iterator<FusedLazyIterator<TreeNode>>(this->expander(), series, iterations == 0 ? 1 : iterations,
+                                                                        this->subtree_length());
+            }
+
+            // Calls visitor(node) for every node of the expansion, in order, until
+            // it returns false. The traversal recurses over the rules directly,
+            // so there are no iterators or successor vectors, and the visitor
+            // call can be inlined. Returns false if the visitor stopped early.
+            template <typename VISITOR>
+            bool for_each(TreeNode &original, unsigned int iterations, VISITOR &&visitor) {
+                EpochGuard guard(this->epochs.get());
+                return this->visit_each(original, iterations, visitor);
+            }
+
+            // Like for_each, but the visitor decides at every internal node
+            // whether to descend, skip the subtree or stop; see TraversalVisitor.
+            // Skipped subtrees aren't expanded, their length comes from length().
+            // Returns false if the visitor stopped.
+            template <typename VISITOR>
+            bool traverse(TreeNode &original, unsigned int iterations, VISITOR &visitor) {
+                EpochGuard guard(this->epochs.get());
+                return this->traverse_nodes(original, iterations, visitor);
+            }
+
+            // Number of nodes the given node expands to after the given number of
+            // iterations. With a pure materialiser the lengths of every subtree
+            // visited are kept until the rules change, so repeated queries over
+            // the same states are answered from the table.
+            unsigned long long length(TreeNode &original, unsigned int iterations) {
+                EpochGuard guard(this->epochs.get());
+                return this->subtree_length(original, iterations);
+            }
+
+            // Occurrences of each key and value in the given generation. With a
+            // pure materialiser equal nodes expand equally, so the generation is
+            // tracked as a count per distinct node and each step costs distinct
+            // nodes times branching, whatever the length. Otherwise the
+            // generation is scanned in full.
+            Histogram<KEY, VALUE> histogram(TreeNode &original, unsigned int iterations) {
+                EpochGuard guard(this->epochs.get());
+                Histogram<KEY, VALUE> result;
+                if (!this->has_pure_materialiser()) {
+                    this->for_each(original, iterations, [&result](TreeNode &node) {
+                        ++result.keys[node.key];
+                        ++result.values[node.value];
+                        return true;
+                    });
+                    return result;
+                }
+
+                map<TreeNode, unsigned long long> generation({ { original, 1 } });
+                for (unsigned int j = 0; j < iterations; ++j) {
+                    map<TreeNode, unsigned long long> next;
+                    for (auto state = generation.begin(); state != generation.end(); ++state) {
+                        TreeNode node = state->first;
+                        const RuleList *rule = this->find_rule(node.key);
+                        for (size_t k = 0; k < System::child_count(rule); ++k) {
+                            next[this->produce_child(node, rule, k)] += state->second;
+                        }
+                    }
+                    generation.swap(next);
+                }
+
+                for (auto state = generation.begin(); state != generation.end(); ++state) {
+                    result.keys[state->first.key] += state->second;
+                    result.values[state->first.value] += state->second;
+                }
+                return result;
+            }
+
+            // Folds the whole expansion with a monoid; see SubtreeSummaries. The
+            // summaries only live for the call, keep a summaries() object to
+            // share them between queries.
+            template <typename MONOID>
+            typename MONOID::Result reduce(TreeNode &original, unsigned int iterations, MONOID monoid) {
+                return SubtreeSummaries<System, MONOID>(this, monoid).summary(original, iterations);
+            }
+
+            // Folds the elements of the expansion with index in [begin, end).
+            template <typename MONOID>
+            typename MONOID::Result reduce(TreeNode &original, unsigned int iterations,
+                                           unsigned long long begin, unsigned long long end, MONOID monoid = MONOID()) {
+                return SubtreeSummaries<System, MONOID>(this, monoid).range(original, iterations, begin, end);
+            }
+
+            template <typename MONOID>
+            shared_ptr<SubtreeSummaries<System, MONOID>> summaries(MONOID monoid = MONOID()) {
+                return make_shared<SubtreeSummaries<System, MONOID>>(this, monoid);
+            }
+
+            // Time index over the expansion, with each element lasting
+            // timing.duration(node); see TimelineIndex. Keep it around to seek
+            // repeatedly without rebuilding the duration summaries.
+            template <typename TIMING>
+            shared_ptr<TimelineIndex<System, TIMING>> timeline(TreeNode &original, unsigned int iterations, TIMING timing = TIMING()) {
+                return make_shared<TimelineIndex<System, TIMING>>(this, original, iterations, timing);
+            }
+
+            // Iterator over the expansion from the element sounding at time t.
+            template <typename TIMING>
+            shared_ptr<Iterator<TreeNode>> seek_time(TreeNode &original, unsigned int iterations, double t, TIMING timing = TIMING()) {
+                return TimelineIndex<System, TIMING>(this, original, iterations, timing).seek(t);
+            }
+
+            // Depth-first traversal with one fixed-size frame per level and no
+            // successor vectors; see BoundedLazyIterator. Like generate(), the
+            // iterator isn't registered for rule updates.
+            shared_ptr<Iterator<TreeNode>> bounded_expand(TreeNode &original, unsigned int iterations) {
+                return this->make_iterator<BoundedLazyIterator<System>>(this, original, iterations);
+            }
+
+            // Hash of the keys and rule nodes of the current rules, in key
+            // order. Unlike rules_version() it only depends on their contents,
+            // so it identifies them across processes; it doesn't cover the
+            // materialiser.
+            template <typename HASHER = RulesHasher<KEY, RULEDATA>>
+            unsigned long long rules_fingerprint(HASHER hasher = HASHER()) {
+                EpochGuard guard(this->epochs.get());
+                const Rules *rules = this->published.load();
+                unsigned long long fingerprint = rules->size();
+                auto mix = [&fingerprint](unsigned long long value) {
+                    fingerprint ^= value + 0x9e3779b97f4a7c15ULL + (fingerprint << 6) + (fingerprint >> 2);
+                };
+                for (auto rule = rules->begin(); rule != rules->end(); ++rule) {
+                    mix(hasher.key(rule->first));
+                    mix(rule->second.size());
+                    for (auto node = rule->second.begin(); node != rule->second.end(); ++node) {
+                        mix(hasher.key(node->key));
+                        mix(hasher.rule_data(node->ruledata));
+                    }
+                }
+                return fingerprint;
+            }
+
+            // Position of a bounded_expand() iterator, tagged with the
+            // fingerprint of the current rules. Fails for other kinds of
+            // iterator.
+            template <typename HASHER = RulesHasher<KEY, RULEDATA>>
+            bool checkpoint(const shared_ptr<Iterator<TreeNode>> &it, TraversalCheckpoint<TreeNode> &result, HASHER hasher = HASHER()) {
+                auto bounded = dynamic_pointer_cast<BoundedLazyIterator<System>>(it);
+                if (!bounded) {
+                    return false;
+                }
+                bounded->save(result);
+                result.rules_fingerprint = this->rules_fingerprint(hasher);
+                return true;
+            }
+
+            // Position after consumed elements of the expansion, for traversals
+            // that count what they've read, like lazy_expand() ones. Takes the
+            // same length lookups as advance(), so O(depth) once they're known.
+            template <typename HASHER = RulesHasher<KEY, RULEDATA>>
+            TraversalCheckpoint<TreeNode> checkpoint(TreeNode &original, unsigned int iterations, unsigned long long consumed,
+                                                     HASHER hasher = HASHER()) {
+                BoundedLazyIterator<System> it(this, original, iterations);
+                it.advance(consumed);
+
+                TraversalCheckpoint<TreeNode> result;
+                it.save(result);
+                result.rules_fingerprint = this->rules_fingerprint(hasher);
+                return result;
+            }
+
+            // Bounded traversal continuing at a checkpoint, without replaying
+            // anything before it. Returns nullptr if the rules' fingerprint
+            // differs from the checkpoint's or it doesn't describe a position;
+            // its path is checked against the depth before anything is built.
+            template <typename HASHER = RulesHasher<KEY, RULEDATA>>
+            shared_ptr<Iterator<TreeNode>> resume(const TraversalCheckpoint<TreeNode> &checkpoint, HASHER hasher = HASHER()) {
+                if (checkpoint.path.size() != TraversalCheckpoint<TreeNode>::levels(checkpoint.iterations) ||
+                    checkpoint.rules_fingerprint != this->rules_fingerprint(hasher)) {
+                    return nullptr;
+                }
+                TreeNode root = checkpoint.root;
+                auto it = this->make_iterator<BoundedLazyIterator<System>>(this, root, checkpoint.iterations);
+                if (!static_pointer_cast<BoundedLazyIterator<System>>(it)->restore(checkpoint)) {
+                    return nullptr;
+                }
+                return it;
+            }
+
+            // Bytes a bounded_expand() traversal of the given depth holds for its
+            // whole lifetime, excluding the shared_ptr control block.
+            static size_t bounded_expand_bytes(unsigned int iterations) {
+                return BoundedLazyIterator<System>::required_bytes(iterations);
+            }
+
+            // Bounded traversal that only yields nodes with one of the given keys,
+            // skipping every subtree KeyReachability says can't produce them
+            // without expanding it.
+            shared_ptr<Iterator<TreeNode>> filtered_expand(TreeNode &original, unsigned int iterations, const set<KEY> &keys) {
+                KeyFilter<System> filter(make_shared<KeyReachability<System>>(this, keys));
+                return this->make_iterator<BoundedLazyIterator<System, KeyFilter<System>>>(this, original, iterations, filter);
+            }
+
+            // Chooses a traversal engine for expanding original; see make_plan().
+            // The plan's describe() is meant for logging.
+            ExecutionPlan<TreeNode> plan(TreeNode &original, unsigned int iterations,
+                                         const PlanRequirements &requirements = PlanRequirements()) {
+                return make_plan(*this, original, iterations, requirements);
+            }
+
+            // Iterator over the planned expansion. Plans for for_each are run
+            // with the bounded engine, the closest pull-style one. Lazy plans
+            // use this system's leaf fusion depth, fused ones the depth the
+            // cost model was measured at.
+            shared_ptr<Iterator<TreeNode>> open(const ExecutionPlan<TreeNode> &plan) {
+                TreeNode root = plan.root;
+                switch (plan.engine) {
+                case TraversalEngine::EAGER: {
+                    vector<TreeNode> result = this->expand(root, static_cast<int>(plan.iterations));
+                    return this->make_iterator<VectorIterator<TreeNode>>(result);
+                }
+                case TraversalEngine::LAZY:
+                    return this->lazy_expand(root, plan.iterations);
+                case TraversalEngine::FUSED:
+                    return this->fused_lazy_expand(root, plan.iterations, fused_engine_depth);
+                case TraversalEngine::GENERATOR:
+                    return this->generate(root, plan.iterations);
+                case TraversalEngine::D0L:
+                    return this->make_iterator<D0LNodeIterator<TreeNode>>(plan.d0l, plan.d0l->root(), plan.iterations);
+                case TraversalEngine::BOUNDED:
+                case TraversalEngine::FOR_EACH:
+                    break;
+                }
+                return this->bounded_expand(root, plan.iterations);
+            }
+
+            // Runs the plan into a for_each-style visitor.
+            template <typename VISITOR>
+            bool execute(const ExecutionPlan<TreeNode> &plan, VISITOR &&visitor) {
+                TreeNode root = plan.root;
+                if (plan.engine == TraversalEngine::FOR_EACH) {
+                    return this->for_each(root, plan.iterations, visitor);
+                }
+                if (plan.engine == TraversalEngine::D0L) {
+                    const D0LSystem<TreeNode> &d0l = *plan.d0l;
+                    return d0l.for_each(d0l.root(), plan.iterations, [&d0l, &visitor](Symbol symbol) {
+                        TreeNode node = d0l.node(symbol);
+                        return visitor(node);
+                    });
+                }
+
+                auto it = this->open(plan);
+                while (it->has_next()) {
+                    if (!visitor(it->next())) {
+                        return false;
+                    }
+                }
+                return true;
+            }
+
+            // expand(original, iterations) as a job, for expansions too large to
+            // run in one go; see ExpandJob.
+            shared_ptr<ExpandJob<System>> expand_job(TreeNode &original, unsigned int iterations) {
+                return make_shared<ExpandJob<System>>(this, original, iterations);
             }
 
             vector<TreeNode> expand(TreeNode &original, int iterations) {
                 if (iterations <= 0) {
+                    LSYSTEM_COUNT(*this->statistics, nodes_produced, 1);
                     return { original };
                 }
             
@@ -175,36 +863,333 @@ namespace trlsai {
                 vector<TreeNode> result;
                 for (auto n = expanded.begin(); n != expanded.end(); ++n) {
                     auto new_seq = this->expand(*n, iterations - 1);
+                    size_t capacity = result.capacity();
                     for (auto val = new_seq.begin(); val != new_seq.end(); ++val) {
                         result.push_back(*val);
                     }
+                    this->count_nodes(capacity, result, new_seq.size());
                 }
 
                 return result;
             }
     
         private:
+            struct RegistrationShard {
+                mutex lock;
+                map<KEY, vector<RegistrationNode>> entries;
+            };
+
             shared_ptr<Rules> rules;
+            // The rules as of the last pin_rules(); while a snapshot holds them
+            // updates copy them first.
+            weak_ptr<const Rules> pinned;
+            // What readers look rules up in; always rules.get(), swapped
+            // atomically in concurrent mode.
+            atomic<Rules *> published;
             shared_ptr<Materialiser<KEY, RULEDATA, VALUE>> materialiser;
-            map<KEY, vector<RegistrationNode>> registrations;
+            vector<unique_ptr<RegistrationShard>> registrations;
+            unsigned int leaf_fusion_depth;
+            atomic<unsigned long> version;
+            map<pair<TreeNode, unsigned int>, unsigned long long> lengths;
+            shared_ptr<SystemCounters> statistics;
+            shared_ptr<EpochDomain> epochs;
+            mutex writer;
+            mutex lengths_lock;
+            // Guards the rules pointer itself against holders taking it while
+            // an update replaces it.
+            mutex rules_lock;
+            // Deferred updates: the version each key last changed in, and the
+            // last version that changed them all.
+            bool deferred;
+            map<KEY, unsigned long> key_updates;
+            unsigned long all_updated;
+            mutex updates_lock;
+
+            // Locks only in concurrent mode.
+            unique_lock<mutex> lock(mutex &m) {
+                return this->epochs == nullptr ? unique_lock<mutex>() : unique_lock<mutex>(m);
+            }
+
+            RegistrationShard &local_shard() {
+                if (this->registrations.size() == 1) {
+                    return *this->registrations[0];
+                }
+                return *this->registrations[hash<thread::id>()(this_thread::get_id()) % this->registrations.size()];
+            }
+
+            bool unregister_it(RegistrationShard &shard, TreeNode &key, shared_ptr<Iterator<TreeNode>> &it) {
+                auto locked = this->lock(shard.lock);
+                auto iter = shard.entries.find(key.key);
+                if (iter == shard.entries.end()) {
+                    return false;
+                }
 
-            shared_ptr<Iterator<TreeNode>> ltree(shared_ptr<Context<TreeNode>> ctx) {
+                vector<RegistrationNode> &elements = iter->second;
+                int size = static_cast<int>(elements.size());
+                for (int j = size - 1; j >= 0; --j) {
+                    const weak_ptr<Iterator<TreeNode>> &registered = elements[static_cast<size_t>(j)].second;
+                    if (!registered.owner_before(it) && !it.owner_before(registered)) {
+                        LSYSTEM_COUNT(*this->statistics, registrations_removed, 1);
+                        elements.erase(elements.begin() + j);
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            // Rules an update can edit: the current ones, or a copy of them when
+            // a snapshot pins them or, in concurrent mode, readers may still be
+            // looking at them.
+            shared_ptr<Rules> writable_rules() {
+                if (this->epochs == nullptr && this->pinned.expired()) {
+                    return this->rules;
+                }
+                LSYSTEM_COUNT(*this->statistics, rule_copies, 1);
+                return make_shared<Rules>(*this->rules);
+            }
+
+            void publish(shared_ptr<Rules> updated) {
+                if (updated == this->rules) {
+                    return;
+                }
+                shared_ptr<Rules> retired = this->rules;
+                {
+                    auto writing = this->lock(this->rules_lock);
+                    this->rules = updated;
+                }
+                this->published.store(updated.get());
+                if (this->epochs != nullptr) {
+                    this->epochs->retire(retired);
+                }
+            }
+
+            // Wraps iterators in a deleter that records their destruction when
+            // instrumentation is enabled.
+            template <typename IT, typename... ARGS>
+            shared_ptr<Iterator<TreeNode>> make_iterator(ARGS&&... args) {
+#ifdef LSYSTEM_INSTRUMENTATION
+                LSYSTEM_COUNT(*this->statistics, iterators_created, 1);
+                LSYSTEM_COUNT(*this->statistics, bytes_allocated, sizeof(IT));
+                auto statistics = this->statistics;
+                return shared_ptr<IT>(new IT(forward<ARGS>(args)...), [statistics](IT *it) {
+                    LSYSTEM_COUNT(*statistics, iterators_destroyed, 1);
+                    delete it;
+                });
+#else
+                return make_shared<IT>(forward<ARGS>(args)...);
+#endif
+            }
+
+            // Records that key, or every key when null, changed in the version
+            // clear_caches() is about to publish. It has to come first: an
+            // iterator that sees the new version and finds no change recorded
+            // for it would take itself to be up to date for good.
+            void record_update(const KEY *key) {
+                auto locked = this->lock(this->updates_lock);
+                unsigned long next = this->version + 1;
+                if (key == nullptr) {
+                    this->all_updated = next;
+                } else {
+                    this->key_updates[*key] = next;
+                }
+            }
+
+            void clear_caches() {
+                auto locked = this->lock(this->lengths_lock);
+                ++this->version;
+                this->lengths.clear();
+            }
+
+            void count_nodes(size_t capacity, const vector<TreeNode> &result) {
+                this->count_nodes(capacity, result, result.size());
+            }
+
+            void count_nodes(size_t capacity, const vector<TreeNode> &result, size_t nodes) {
+                LSYSTEM_COUNT(*this->statistics, nodes_produced, nodes);
+                if (result.capacity() > capacity) {
+                    LSYSTEM_COUNT(*this->statistics, bytes_allocated, (result.capacity() - capacity) * sizeof(TreeNode));
+                }
+            }
+
+            // lazy_expand() with the given leaf fusion depth instead of the
+            // system's own.
+            shared_ptr<Iterator<TreeNode>> fused_lazy_expand(TreeNode &original, unsigned int iterations, unsigned int fusion_depth) {
+                auto ctx = make_shared<Context<TreeNode>>(original);
+                ctx->iterations = iterations;
+
+                auto retval = this->ltree(ctx, fusion_depth < 1 ? 1 : fusion_depth);
+                this->register_it(original, retval);
+                return retval;
+            }
+
+            shared_ptr<Iterator<TreeNode>> ltree(shared_ptr<Context<TreeNode>> ctx, unsigned int fusion_depth) {
                 if (ctx->iterations <= 0) {
                     TreeNode element = ctx->element;
                     vector<TreeNode> series({ element });
-                    return make_shared<VectorIterator<TreeNode>>(series);
+                    return this->make_iterator<VectorIterator<TreeNode>>(series);
                 }
 
                 vector<TreeNode> expanded;
                 this->expand(ctx->element, expanded);
 
                 if (ctx->iterations == 1) {
-                    return make_shared<VectorIterator<TreeNode>>(expanded);
+                    return this->make_iterator<VectorIterator<TreeNode>>(expanded);
+                }
+
+                if (ctx->iterations <= fusion_depth) {
+                    return this->make_iterator<FusedLazyIterator<TreeNode>>(this->expander(), expanded, ctx->iterations,
+                                                                            this->subtree_length());
+                }
+
+                function<unsigned long long(TreeNode&)> child_length;
+                if (this->has_pure_materialiser()) {
+                    child_length = [this, ctx](TreeNode &node) { return this->length(node, ctx->iterations - 1); };
+                }
+
+                return this->make_iterator<NestedLazyIterator<TreeNode>>(this,
+                                                                         [this, ctx, fusion_depth](TreeNode &node) {
+                                                                             LSYSTEM_COUNT(*this->statistics, bytes_allocated, sizeof(Context<TreeNode>));
+                                                                             return this->ltree(ctx->child(node), fusion_depth);
+                                                                         },
+                                                                         expanded, move(child_length));
+            }
+
+            // Recursive parts of for_each() and traverse(), which hold the read
+            // guard for the whole traversal.
+            template <typename VISITOR>
+            bool visit_each(TreeNode &original, unsigned int iterations, VISITOR &visitor) {
+                if (iterations == 0) {
+                    return visitor(original);
+                }
+
+                const RuleList *rule = this->find_rule(original.key);
+                for (size_t j = 0; j < System::child_count(rule); ++j) {
+                    TreeNode child = this->produce_child(original, rule, j);
+                    if (!this->visit_each(child, iterations - 1, visitor)) {
+                        return false;
+                    }
+                }
+                return true;
+            }
+
+            template <typename VISITOR>
+            bool traverse_nodes(TreeNode &original, unsigned int iterations, VISITOR &visitor) {
+                if (iterations == 0) {
+                    return visitor.visit(original);
+                }
+
+                switch (visitor.enter(original, iterations)) {
+                case Descent::STOP:
+                    return false;
+                case Descent::SKIP:
+                    visitor.skip(original, iterations, this->length(original, iterations));
+                    return true;
+                case Descent::DESCEND:
+                    break;
                 }
 
-                return make_shared<NestedLazyIterator<TreeNode>>(this,
-                                                                 [this, ctx](TreeNode &node) { return this->ltree(ctx->child(node)); },
-                                                                 expanded);
+                const RuleList *rule = this->find_rule(original.key);
+                for (size_t j = 0; j < System::child_count(rule); ++j) {
+                    TreeNode child = this->produce_child(original, rule, j);
+                    if (!this->traverse_nodes(child, iterations - 1, visitor)) {
+                        return false;
+                    }
+                }
+                return true;
+            }
+
+            void refresh(const KEY &key) {
+                for (auto shard = this->registrations.begin(); shard != this->registrations.end(); ++shard) {
+                    auto locked = this->lock((*shard)->lock);
+                    auto registration = (*shard)->entries.find(key);
+                    if (registration != (*shard)->entries.end()) {
+                        this->refresh(registration->second);
+                    }
+                }
+            }
+
+            void refresh(vector<RegistrationNode> &elements) {
+                this->compact(elements);
+                for (auto it = elements.begin(); it != elements.end(); ++it) {
+                    this->refresh(*it);
+                }
+            }
+
+            // Re-expands a registered node into its iterator, if still alive,
+            // and returns the number of nodes produced.
+            unsigned long long refresh(RegistrationNode &element) {
+                auto iterator = element.second.lock();
+                if (iterator == nullptr) {
+                    return 0;
+                }
+
+                vector<TreeNode> expanded;
+                this->expand(element.first, expanded);
+                if (this->epochs == nullptr) {
+                    iterator->update_series(expanded);
+                } else {
+                    iterator->post_series(expanded);
+                }
+                return expanded.size();
+            }
+
+            void compact(vector<RegistrationNode> &elements) {
+                size_t live = 0;
+                for (size_t j = 0; j < elements.size(); ++j) {
+                    if (!elements[j].second.expired()) {
+                        if (live != j) {
+                            elements[live] = elements[j];
+                        }
+                        ++live;
+                    }
+                }
+                LSYSTEM_COUNT(*this->statistics, registrations_removed, elements.size() - live);
+                elements.erase(elements.begin() + static_cast<long>(live), elements.end());
+            }
+
+            function<void(TreeNode&, vector<TreeNode>&)> expander() {
+                return [this](TreeNode &node, vector<TreeNode> &result) { this->expand(node, result); };
+            }
+
+            unsigned long long subtree_length(TreeNode &original, unsigned int iterations) {
+                if (iterations == 0) {
+                    return 1;
+                }
+
+                bool cached = this->has_pure_materialiser();
+                unsigned long seen = this->version;
+                if (cached) {
+                    auto locked = this->lock(this->lengths_lock);
+                    auto known = this->lengths.find(make_pair(original, iterations));
+                    if (known != this->lengths.end()) {
+                        return known->second;
+                    }
+                }
+
+                unsigned long long total = 0;
+                const RuleList *rule = this->find_rule(original.key);
+                for (size_t j = 0; j < System::child_count(rule); ++j) {
+                    TreeNode child = this->produce_child(original, rule, j);
+                    total += this->subtree_length(child, iterations - 1);
+                }
+
+                // A length computed while the rules changed may be stale.
+                if (cached) {
+                    auto locked = this->lock(this->lengths_lock);
+                    if (this->version == seen) {
+                        this->lengths[make_pair(original, iterations)] = total;
+                    }
+                }
+                return total;
+            }
+
+            // Subtree lengths for iterators to skip with, only when they can be
+            // cached; otherwise computing one costs as much as stepping over it.
+            function<unsigned long long(TreeNode&, unsigned int)> subtree_length() {
+                if (!this->has_pure_materialiser()) {
+                    return nullptr;
+                }
+                return [this](TreeNode &node, unsigned int iterations) { return this->length(node, iterations); };
             }
         };
     }
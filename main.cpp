@@ -62,14 +62,11 @@ void benchmark() {
 
     IntSystem::TreeNode original(1, 1);
 
-    int iterations = 30;
-
-    auto it = system.lazy_expand(original, iterations);
+    unsigned int iterations = 30;
 
     int values = 0;
 
-    while (it->has_next()) {
-        IntSystem::TreeNode &next = it->next();
+    system.for_each(original, iterations, [&values](IntSystem::TreeNode &next) {
         ++values;
         if (next.value > 21) {
             cout << "More than 21 " << endl;
@@ -78,7 +75,8 @@ void benchmark() {
         if (values % 1000000 == 0) {
             cout << "Processed " << values << " values." << endl;
         }
-    }
+        return true;
+    });
 
     cout << "Done, " << values << " values." << endl;
 }
@@ -193,10 +191,11 @@ void test_modulo_with_duration() {
             vector<RuleNode<int, Duration>> updated;
             system.update_rule(0, updated);
         } else if (count == 150) {
-            vector<RuleNode<int, Duration>> updated;
+            IntDurationSystem::Rules updated;
             for (int j = -10; j <= 10; ++j) {
-                system.update_rule(j, updated);
+                updated[j] = {};
             }
+            system.update_rules(updated);
         }
         
         IntDurationSystem::TreeNode &next = it->next();
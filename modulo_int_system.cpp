@@ -34,6 +34,10 @@ namespace trlsai {
             return Triplet<int, empty, int>(final_val, final_val);
         }
 
+        bool ModuloIntMaterialiser::is_pure() {
+            return true;
+        }
+
         ModuloDurationMaterialiser::ModuloDurationMaterialiser(int min, int max): ModuloMaterialiserBase(min, max) { }
 
         Triplet<int, Duration, ModuloValue> ModuloDurationMaterialiser::produce(const int &key, const Duration &duration,
@@ -45,6 +49,10 @@ namespace trlsai {
             value.duration.denominator = parent.value.duration.denominator * duration.denominator;
             return Triplet<int, Duration, ModuloValue>(final_val, duration, value);
         }
+
+        bool ModuloDurationMaterialiser::is_pure() {
+            return true;
+        }
     }
 }
 
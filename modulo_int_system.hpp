@@ -23,6 +23,7 @@ namespace trlsai {
         public:
             ModuloIntMaterialiser(int min, int max);
             Triplet<int, empty, int> produce(const int &key, const empty &ruledata, const Triplet<int, empty, int> &parent, unsigned int total_siblings) override;
+            bool is_pure() override;
             virtual ~ModuloIntMaterialiser() = default;
         };
 
@@ -36,6 +37,24 @@ namespace trlsai {
             duration_value denominator;
         };
 
+        inline bool operator<(const Duration &left, const Duration &right) {
+            return left.numerator < right.numerator ||
+                (left.numerator == right.numerator && left.denominator < right.denominator);
+        }
+
+        // Lets systems with durations as rule data fingerprint their rules;
+        // see System::rules_fingerprint().
+        template <typename KEY>
+        struct RulesHasher<KEY, Duration> {
+            unsigned long long key(const KEY &key) const {
+                return hash<KEY>()(key);
+            }
+
+            unsigned long long rule_data(const Duration &data) const {
+                return static_cast<unsigned long long>(data.numerator) * 31 + data.denominator;
+            }
+        };
+
         struct ModuloValue {
             ModuloValue() = default;
             ModuloValue(int interval, Duration duration) : interval(interval), duration(duration) { }
@@ -43,11 +62,24 @@ namespace trlsai {
             Duration duration;
         };
 
+        inline bool operator<(const ModuloValue &left, const ModuloValue &right) {
+            return left.interval < right.interval ||
+                (left.interval == right.interval && left.duration < right.duration);
+        }
+
+        // Timing for TimelineIndex: a node lasts its duration, as a fraction.
+        struct ModuloDurationTiming {
+            double duration(const Triplet<int, Duration, ModuloValue> &node) const {
+                return static_cast<double>(node.value.duration.numerator) / static_cast<double>(node.value.duration.denominator);
+            }
+        };
+
         class ModuloDurationMaterialiser : public ModuloMaterialiserBase, public Materialiser<int, Duration, ModuloValue> {
         public:
             ModuloDurationMaterialiser(int min, int max);
             Triplet<int, Duration, ModuloValue> produce(const int &key, const Duration &ruledata, const Triplet<int, Duration, ModuloValue> &parent,
                                                               unsigned int total_siblings) override;
+            bool is_pure() override;
             virtual ~ModuloDurationMaterialiser() = default;
         };
     }
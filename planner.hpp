@@ -0,0 +1,129 @@
+#ifndef __MODAL_LSYSTEM_PLANNER__
+#define __MODAL_LSYSTEM_PLANNER__
+
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <string>
+#include "d0l.hpp"
+#include "rule_analysis.hpp"
+
+using namespace std;
+
+namespace trlsai {
+    namespace lsystem {
+        struct PlanRequirements {
+            PlanRequirements(): live_updates(false), push_style(false),
+                                max_bytes(numeric_limits<unsigned long long>::max()) { }
+            // The traversal has to follow update_rule() calls made while it runs.
+            bool live_updates;
+            // The consumer can take a visitor instead of an iterator.
+            bool push_style;
+            unsigned long long max_bytes;
+        };
+
+        template <typename TREENODE>
+        struct ExecutionPlan {
+            ExecutionPlan(): engine(TraversalEngine::BOUNDED), iterations(0), timed(false), estimated_seconds(0.0), estimated_bytes(0) { }
+            TraversalEngine engine;
+            TREENODE root;
+            unsigned int iterations;
+            // Whether the system was analysed, so estimated_seconds and the
+            // report mean anything.
+            bool timed;
+            double estimated_seconds;
+            unsigned long long estimated_bytes;
+            GrowthReport report;
+            string reason;
+            // Compiled table, when the D0L engine is chosen.
+            shared_ptr<D0LSystem<TREENODE>> d0l;
+
+            string describe() const {
+                ostringstream out;
+                out << "engine=" << engine_name(this->engine) << " depth=" << this->iterations << " estimated_seconds=";
+                if (this->timed) {
+                    out << this->estimated_seconds;
+                } else {
+                    out << "unknown";
+                }
+                out << " estimated_bytes=" << this->estimated_bytes;
+                if (!this->report.lengths.empty()) {
+                    out << " symbols=" << this->report.lengths.back() << " growth_rate=" << this->report.growth_rate
+                        << " states=" << this->report.states;
+                }
+                out << " (" << this->reason << ")";
+                return out.str();
+            }
+        };
+
+        // Picks the engine with the lowest estimated time among those that meet
+        // the requirements and fit the memory budget, from the statistics of
+        // analyse_growth(). Systems with impure materialisers aren't analysed,
+        // since that would mean counting their whole expansion, so their plans
+        // aren't timed.
+        template <typename SYSTEM>
+        ExecutionPlan<typename SYSTEM::TreeNode> make_plan(SYSTEM &system, typename SYSTEM::TreeNode &root, unsigned int iterations,
+                                                           const PlanRequirements &requirements, const CostModel &model = CostModel()) {
+            using TreeNode = typename SYSTEM::TreeNode;
+            ExecutionPlan<TreeNode> plan;
+            plan.root = root;
+            plan.iterations = iterations;
+
+            plan.timed = system.has_pure_materialiser();
+            auto d0l = make_shared<D0LSystem<TreeNode>>();
+            if (plan.timed) {
+                plan.report = analyse_growth(system, root, iterations, *d0l, model);
+            }
+
+            if (requirements.live_updates) {
+                plan.engine = TraversalEngine::LAZY;
+                plan.reason = "live updates need registered iterators";
+                if (plan.timed) {
+                    plan.estimated_seconds = plan.report.cost(TraversalEngine::LAZY)->seconds;
+                    plan.estimated_bytes = plan.report.cost(TraversalEngine::LAZY)->bytes;
+                } else {
+                    plan.estimated_bytes = static_cast<unsigned long long>(iterations) * system.max_branching() * sizeof(TreeNode);
+                }
+                return plan;
+            }
+
+            if (!plan.timed) {
+                plan.engine = TraversalEngine::BOUNDED;
+                plan.reason = "impure materialiser, lengths unknown";
+                plan.estimated_bytes = SYSTEM::bounded_expand_bytes(iterations);
+                return plan;
+            }
+
+            const EngineCost *best = nullptr;
+            const EngineCost *smallest = nullptr;
+            for (auto cost = plan.report.costs.begin(); cost != plan.report.costs.end(); ++cost) {
+                if (cost->engine == TraversalEngine::FOR_EACH && !requirements.push_style) {
+                    continue;
+                }
+                if (smallest == nullptr || cost->bytes < smallest->bytes) {
+                    smallest = &*cost;
+                }
+                if (cost->bytes <= requirements.max_bytes && (best == nullptr || cost->seconds < best->seconds)) {
+                    best = &*cost;
+                }
+            }
+
+            if (best != nullptr) {
+                plan.reason = "fastest within the memory budget";
+            } else {
+                best = smallest;
+                plan.reason = "nothing fits the memory budget, smallest footprint";
+            }
+            plan.engine = best->engine;
+            plan.estimated_seconds = best->seconds;
+            plan.estimated_bytes = best->bytes;
+
+            if (plan.engine == TraversalEngine::D0L) {
+                plan.d0l = d0l;
+            }
+            return plan;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,148 @@
+#ifndef __MODAL_LSYSTEM_PREFETCH_ITERATOR__
+#define __MODAL_LSYSTEM_PREFETCH_ITERATOR__
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "lazy_iterator.hpp"
+
+using namespace std;
+
+namespace trlsai {
+    namespace lsystem {
+        // Drains another iterator on a producer thread into a single-producer,
+        // single-consumer ring, so the expansion and its allocations happen
+        // ahead of the consumer and off its thread. The ring holds up to
+        // lookahead elements, rounded up to a power of two.
+        //
+        // available(), try_next() and next_batch() are wait-free: they only
+        // read what's already in the ring. has_next() has to wait when the
+        // ring is empty and the producer hasn't finished. The wrapped iterator
+        // is only used by the producer thread, so whatever it reads mustn't
+        // change under it: wrap snapshot or generated iterators, or enable
+        // concurrency on the system before updating it.
+        template <typename T>
+        class PrefetchIterator : public Iterator<T> {
+        public:
+            PrefetchIterator(shared_ptr<Iterator<T>> inner, size_t lookahead = 4096)
+                : Iterator<T>(), inner(inner), head(0), tail(0), done(false), stopping(false) {
+                size_t capacity = 1;
+                while (capacity < lookahead) {
+                    capacity <<= 1;
+                }
+                this->ring.resize(capacity);
+                this->mask = capacity - 1;
+                this->producer = thread([this]() { this->produce(); });
+            }
+
+            PrefetchIterator(const PrefetchIterator &) = delete;
+            PrefetchIterator &operator=(const PrefetchIterator &) = delete;
+
+            ~PrefetchIterator() {
+                this->stopping.store(true);
+                this->producer.join();
+            }
+
+            bool has_next() override {
+                Backoff backoff;
+                while (true) {
+                    if (this->available() > 0) {
+                        return true;
+                    }
+                    // Elements pushed before done was set are visible once it is.
+                    if (this->done.load(memory_order_acquire)) {
+                        return this->available() > 0;
+                    }
+                    backoff.pause();
+                }
+            }
+
+            T &next() override {
+                this->has_next();
+                this->try_next(this->current);
+                return this->current;
+            }
+
+            // Elements ready to be taken without waiting.
+            size_t available() const {
+                return this->tail.load(memory_order_acquire) - this->head.load(memory_order_relaxed);
+            }
+
+            bool try_next(T &result) {
+                return this->next_batch(&result, 1) == 1;
+            }
+
+            // Moves up to count ready elements to result and returns how many.
+            size_t next_batch(T *result, size_t count) {
+                size_t head = this->head.load(memory_order_relaxed);
+                size_t ready = this->tail.load(memory_order_acquire) - head;
+                size_t taken = ready < count ? ready : count;
+                for (size_t j = 0; j < taken; ++j) {
+                    result[j] = move(this->ring[(head + j) & this->mask]);
+                }
+                this->head.store(head + taken, memory_order_release);
+                return taken;
+            }
+
+            size_t capacity() const {
+                return this->ring.size();
+            }
+
+        private:
+            // Spins briefly, then yields, then sleeps, so a side left waiting
+            // for a long time doesn't hold a core.
+            struct Backoff {
+                Backoff(): rounds(0) { }
+
+                void pause() {
+                    if (this->rounds < 64) {
+                        ++this->rounds;
+                    } else if (this->rounds < 128) {
+                        ++this->rounds;
+                        this_thread::yield();
+                    } else {
+                        this_thread::sleep_for(chrono::microseconds(50));
+                    }
+                }
+
+                unsigned int rounds;
+            };
+
+            shared_ptr<Iterator<T>> inner;
+            vector<T> ring;
+            size_t mask;
+            T current;
+            // Written by the consumer and producer respectively; kept on
+            // separate cache lines.
+            atomic<size_t> head;
+            char padding[64];
+            atomic<size_t> tail;
+            atomic<bool> done;
+            atomic<bool> stopping;
+            thread producer;
+
+            void produce() {
+                while (!this->stopping.load(memory_order_relaxed) && this->inner->has_next()) {
+                    T &element = this->inner->next();
+                    size_t tail = this->tail.load(memory_order_relaxed);
+
+                    Backoff backoff;
+                    while (tail - this->head.load(memory_order_acquire) == this->ring.size()) {
+                        if (this->stopping.load(memory_order_relaxed)) {
+                            return;
+                        }
+                        backoff.pause();
+                    }
+
+                    this->ring[tail & this->mask] = element;
+                    this->tail.store(tail + 1, memory_order_release);
+                }
+                this->done.store(true, memory_order_release);
+            }
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,150 @@
+#ifndef __MODAL_LSYSTEM_REALTIME__
+#define __MODAL_LSYSTEM_REALTIME__
+
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include "snapshot.hpp"
+
+using namespace std;
+
+namespace trlsai {
+    namespace lsystem {
+        using RealtimeViolationHandler = void (*)();
+
+        inline bool &realtime_section_active() {
+            static thread_local bool active = false;
+            return active;
+        }
+
+        inline RealtimeViolationHandler &realtime_violation_handler() {
+            static RealtimeViolationHandler handler = abort;
+            return handler;
+        }
+
+        // Called with the allocator hooks installed by
+        // LSYSTEM_REALTIME_ALLOCATION_TRAP whenever the program allocates or
+        // frees. Inside a real-time section that's a violation, which aborts
+        // unless another handler was set.
+        inline void realtime_allocator_called() {
+            if (realtime_section_active()) {
+                realtime_violation_handler()();
+            }
+        }
+
+        inline void set_realtime_violation_handler(RealtimeViolationHandler handler) {
+            realtime_violation_handler() = handler;
+        }
+
+        // Marks the current thread as inside a real-time section for its
+        // lifetime. Only debug builds check anything.
+        struct RealtimeSection {
+#ifndef NDEBUG
+            RealtimeSection(): previous(realtime_section_active()) {
+                realtime_section_active() = true;
+            }
+
+            ~RealtimeSection() {
+                realtime_section_active() = previous;
+            }
+
+            bool previous;
+#else
+            RealtimeSection() { }
+#endif
+        };
+
+        // Traversal for real-time threads: has_next(), next() and advance()
+        // never allocate, lock or call the system allocator. The rules are a
+        // pinned snapshot, so updates never reach it and there's no registry;
+        // the frames for every level up to max_depth are allocated when it's
+        // built, and reseed() starts a new traversal in them. Subtrees are
+        // skipped by stepping, since the length table would allocate. The
+        // materialiser has to be real-time safe as well.
+        //
+        // In debug builds every call runs in a RealtimeSection, so with the
+        // allocation trap installed a violation is caught where it happens.
+        template <typename SYSTEM>
+        class RealtimeIterator : public BoundedLazyIterator<RuleSnapshot<SYSTEM>> {
+        public:
+            using TreeNode = typename SYSTEM::TreeNode;
+
+            RealtimeIterator(shared_ptr<RuleSnapshot<SYSTEM>> snapshot, TreeNode &original, unsigned int max_depth)
+                : BoundedLazyIterator<RuleSnapshot<SYSTEM>>(snapshot.get(), original, max_depth), snapshot(snapshot) {
+            }
+
+            bool has_next() override {
+                RealtimeSection section;
+                return BoundedLazyIterator<RuleSnapshot<SYSTEM>>::has_next();
+            }
+
+            TreeNode &next() override {
+                RealtimeSection section;
+                return BoundedLazyIterator<RuleSnapshot<SYSTEM>>::next();
+            }
+
+            unsigned long long advance(unsigned long long n) override {
+                RealtimeSection section;
+                return Iterator<TreeNode>::advance(n);
+            }
+
+            bool reseed(TreeNode &original, unsigned int iterations) {
+                RealtimeSection section;
+                return BoundedLazyIterator<RuleSnapshot<SYSTEM>>::reseed(original, iterations);
+            }
+
+        private:
+            shared_ptr<RuleSnapshot<SYSTEM>> snapshot;
+        };
+    }
+}
+
+// Replaces the global allocation functions, nothrow ones included, with ones
+// that report calls made inside a RealtimeSection. Use it in a single translation unit of a debug
+// build; it expands to nothing when NDEBUG is defined.
+#ifndef NDEBUG
+#define LSYSTEM_REALTIME_ALLOCATION_TRAP                                \
+    void *operator new(std::size_t size) {                              \
+        ::trlsai::lsystem::realtime_allocator_called();                 \
+        void *memory = std::malloc(size == 0 ? 1 : size);               \
+        if (memory == nullptr) {                                        \
+            throw std::bad_alloc();                                     \
+        }                                                               \
+        return memory;                                                  \
+    }                                                                   \
+    void *operator new[](std::size_t size) {                            \
+        return ::operator new(size);                                    \
+    }                                                                   \
+    void *operator new(std::size_t size, const std::nothrow_t &) noexcept { \
+        ::trlsai::lsystem::realtime_allocator_called();                 \
+        return std::malloc(size == 0 ? 1 : size);                       \
+    }                                                                   \
+    void *operator new[](std::size_t size, const std::nothrow_t &tag) noexcept { \
+        return ::operator new(size, tag);                               \
+    }                                                                   \
+    void operator delete(void *memory) noexcept {                       \
+        if (memory != nullptr) {                                        \
+            ::trlsai::lsystem::realtime_allocator_called();             \
+        }                                                               \
+        std::free(memory);                                              \
+    }                                                                   \
+    void operator delete[](void *memory) noexcept {                     \
+        ::operator delete(memory);                                      \
+    }                                                                   \
+    void operator delete(void *memory, std::size_t) noexcept {          \
+        ::operator delete(memory);                                      \
+    }                                                                   \
+    void operator delete[](void *memory, std::size_t) noexcept {        \
+        ::operator delete(memory);                                      \
+    }                                                                   \
+    void operator delete(void *memory, const std::nothrow_t &) noexcept { \
+        ::operator delete(memory);                                      \
+    }                                                                   \
+    void operator delete[](void *memory, const std::nothrow_t &) noexcept { \
+        ::operator delete(memory);                                      \
+    }
+#else
+#define LSYSTEM_REALTIME_ALLOCATION_TRAP
+#endif
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef __MODAL_LSYSTEM_REDUCTION__
+#define __MODAL_LSYSTEM_REDUCTION__
+
+#include <algorithm>
+#include <map>
+#include <utility>
+
+using namespace std;
+
+namespace trlsai {
+    namespace lsystem {
+        // Folds a generation with a monoid, which has to provide:
+        //
+        //   using Result = ...;
+        //   Result identity() const;
+        //   Result lift(const TreeNode &node) const;
+        //   Result combine(const Result &left, const Result &right) const;
+        //
+        // combine must be associative, but needn't be commutative; results are
+        // always combined in expansion order. The summary of every subtree is
+        // kept per (node, remaining depth), so with a pure materialiser a whole
+        // generation costs distinct nodes times depth, and a range of it only
+        // adds the subtrees along its two edges. Summaries are dropped when the
+        // rules change. Without a pure materialiser nothing is kept and every
+        // query walks the nodes it covers.
+        template <typename SYSTEM, typename MONOID>
+        class SubtreeSummaries {
+        public:
+            using TreeNode = typename SYSTEM::TreeNode;
+            using Result = typename MONOID::Result;
+
+            SubtreeSummaries(SYSTEM *system, MONOID monoid = MONOID())
+                : system(system), monoid(monoid), version(system->rules_version()) {
+            }
+
+            // Summary of the whole expansion of node after remaining iterations.
+            Result summary(TreeNode &node, unsigned int remaining) {
+                auto guard = this->system->read_guard();
+                return this->fold(node, remaining);
+            }
+
+            // Summary of the elements with index in [begin, end) of the same
+            // expansion. Subtrees wholly inside the range use their summaries,
+            // only the ones straddling its edges are descended into.
+            Result range(TreeNode &node, unsigned int remaining, unsigned long long begin, unsigned long long end) {
+                auto guard = this->system->read_guard();
+                return this->fold_range(node, remaining, begin, end);
+            }
+
+            const MONOID &get_monoid() const {
+                return this->monoid;
+            }
+
+        private:
+            SYSTEM *system;
+            MONOID monoid;
+            unsigned long version;
+            map<pair<TreeNode, unsigned int>, Result> table;
+
+            Result fold(TreeNode &node, unsigned int remaining) {
+                if (remaining == 0) {
+                    return this->monoid.lift(node);
+                }
+
+                bool cached = this->system->has_pure_materialiser();
+                if (cached) {
+                    if (this->version != this->system->rules_version()) {
+                        this->table.clear();
+                        this->version = this->system->rules_version();
+                    }
+
+                    auto known = this->table.find(make_pair(node, remaining));
+                    if (known != this->table.end()) {
+                        return known->second;
+                    }
+                }
+
+                Result result = this->monoid.identity();
+                auto rule = this->system->find_rule(node.key);
+                for (size_t j = 0; j < SYSTEM::child_count(rule); ++j) {
+                    TreeNode child = this->system->produce_child(node, rule, j);
+                    result = this->monoid.combine(result, this->fold(child, remaining - 1));
+                }
+
+                if (cached) {
+                    this->table[make_pair(node, remaining)] = result;
+                }
+                return result;
+            }
+
+            Result fold_range(TreeNode &node, unsigned int remaining, unsigned long long begin, unsigned long long end) {
+                if (begin >= end) {
+                    return this->monoid.identity();
+                }
+                if (begin == 0 && end >= this->system->length(node, remaining)) {
+                    return this->fold(node, remaining);
+                }
+
+                Result result = this->monoid.identity();
+                unsigned long long offset = 0;
+                auto rule = this->system->find_rule(node.key);
+                for (size_t j = 0; j < SYSTEM::child_count(rule) && offset < end; ++j) {
+                    TreeNode child = this->system->produce_child(node, rule, j);
+                    unsigned long long length = this->system->length(child, remaining - 1);
+                    if (offset + length > begin) {
+                        unsigned long long from = begin > offset ? begin - offset : 0;
+                        unsigned long long to = min(end - offset, length);
+                        result = this->monoid.combine(result, this->fold_range(child, remaining - 1, from, to));
+                    }
+                    offset += length;
+                }
+                return result;
+            }
+        };
+    }
+}
+
+#endif
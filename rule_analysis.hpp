@@ -0,0 +1,266 @@
+#ifndef __MODAL_LSYSTEM_RULE_ANALYSIS__
+#define __MODAL_LSYSTEM_RULE_ANALYSIS__
+
+#include <cmath>
+#include <map>
+#include <memory>
+#include <set>
+#include <utility>
+#include <vector>
+#include "d0l.hpp"
+
+using namespace std;
+
+namespace trlsai {
+    namespace lsystem {
+        // Answers whether any of a set of keys can appear a given number of
+        // levels below a node. The materialiser decides the keys of the
+        // children, so the table is kept per (node, remaining depth) rather
+        // than per key; with finite-state materialisers it stays small. Without
+        // a pure materialiser nothing can be ruled out and every internal node
+        // is reported as reachable.
+        template <typename SYSTEM>
+        class KeyReachability {
+        public:
+            using TreeNode = typename SYSTEM::TreeNode;
+
+            KeyReachability(SYSTEM *system, const set<typename SYSTEM::Key> &keys)
+                : system(system), keys(keys), version(system->rules_version()) {
+            }
+
+            bool reachable(TreeNode &node, unsigned int remaining) {
+                if (remaining == 0) {
+                    return this->keys.find(node.key) != this->keys.end();
+                }
+                auto guard = this->system->read_guard();
+                return this->search(node, remaining);
+            }
+
+        private:
+            SYSTEM *system;
+            set<typename SYSTEM::Key> keys;
+            unsigned long version;
+            map<pair<TreeNode, unsigned int>, bool> table;
+
+            bool search(TreeNode &node, unsigned int remaining) {
+                if (remaining == 0) {
+                    return this->keys.find(node.key) != this->keys.end();
+                }
+
+                if (!this->system->has_pure_materialiser()) {
+                    return true;
+                }
+
+                if (this->version != this->system->rules_version()) {
+                    this->table.clear();
+                    this->version = this->system->rules_version();
+                }
+
+                auto known = this->table.find(make_pair(node, remaining));
+                if (known != this->table.end()) {
+                    return known->second;
+                }
+
+                bool result = false;
+                auto rule = this->system->find_rule(node.key);
+                for (size_t j = 0; j < SYSTEM::child_count(rule) && !result; ++j) {
+                    TreeNode child = this->system->produce_child(node, rule, j);
+                    result = this->search(child, remaining - 1);
+                }
+
+                this->table[make_pair(node, remaining)] = result;
+                return result;
+            }
+        };
+
+        template <typename SYSTEM>
+        struct KeyFilter {
+            KeyFilter(shared_ptr<KeyReachability<SYSTEM>> reachability): reachability(reachability) { }
+
+            bool accept(typename SYSTEM::TreeNode &node, unsigned int remaining) {
+                return this->reachability->reachable(node, remaining);
+            }
+
+            shared_ptr<KeyReachability<SYSTEM>> reachability;
+        };
+
+        enum class TraversalEngine { EAGER, LAZY, FUSED, GENERATOR, BOUNDED, FOR_EACH, D0L };
+
+        // Leaf fusion depth FUSED plans run with, as benchmarked by lazy_fused3.
+        const unsigned int fused_engine_depth = 3;
+
+        const TraversalEngine traversal_engines[] = {
+            TraversalEngine::EAGER, TraversalEngine::LAZY, TraversalEngine::FUSED, TraversalEngine::GENERATOR,
+            TraversalEngine::BOUNDED, TraversalEngine::FOR_EACH, TraversalEngine::D0L
+        };
+
+        inline const char *engine_name(TraversalEngine engine) {
+            switch (engine) {
+            case TraversalEngine::EAGER:
+                return "eager";
+            case TraversalEngine::LAZY:
+                return "lazy";
+            case TraversalEngine::FUSED:
+                return "lazy_fused3";
+            case TraversalEngine::GENERATOR:
+                return "generator";
+            case TraversalEngine::BOUNDED:
+                return "bounded";
+            case TraversalEngine::FOR_EACH:
+                return "for_each";
+            case TraversalEngine::D0L:
+                return "d0l";
+            }
+            return "unknown";
+        }
+
+        // Per-symbol costs the estimates are scaled by. The defaults are what
+        // modulo_lsystem_bench measures for an optimised build on the case1
+        // rules; replace them with figures from the target machine.
+        struct CostModel {
+            CostModel(): materialiser_call_ns(10.0) {
+                this->ns_per_symbol[static_cast<size_t>(TraversalEngine::EAGER)] = 200.0;
+                this->ns_per_symbol[static_cast<size_t>(TraversalEngine::LAZY)] = 430.0;
+                this->ns_per_symbol[static_cast<size_t>(TraversalEngine::FUSED)] = 290.0;
+                this->ns_per_symbol[static_cast<size_t>(TraversalEngine::GENERATOR)] = 30.0;
+                this->ns_per_symbol[static_cast<size_t>(TraversalEngine::BOUNDED)] = 25.0;
+                this->ns_per_symbol[static_cast<size_t>(TraversalEngine::FOR_EACH)] = 19.0;
+                this->ns_per_symbol[static_cast<size_t>(TraversalEngine::D0L)] = 10.0;
+            }
+
+            double ns_per_symbol[7];
+            double materialiser_call_ns;
+        };
+
+        struct EngineCost {
+            EngineCost(TraversalEngine engine, double seconds, unsigned long long bytes): engine(engine), seconds(seconds), bytes(bytes) { }
+            TraversalEngine engine;
+            double seconds;
+            unsigned long long bytes;
+        };
+
+        struct GrowthReport {
+            GrowthReport(): finite_state(false), states(0), max_branching(1), growth_rate(0.0) { }
+            // Whether the nodes reachable from the root compiled to a D0L table,
+            // and how many distinct ones there are.
+            bool finite_state;
+            size_t states;
+            size_t max_branching;
+            // Spectral radius of the D0L incidence matrix when finite-state,
+            // otherwise the geometric mean of the last few length ratios.
+            double growth_rate;
+            // lengths[d] is the exact length of generation d, for d up to the
+            // requested depth.
+            vector<unsigned long long> lengths;
+            // Estimated cost of running each engine to the requested depth. The
+            // D0L engine is only listed for finite-state systems.
+            vector<EngineCost> costs;
+
+            const EngineCost *cost(TraversalEngine engine) const {
+                for (auto it = this->costs.begin(); it != this->costs.end(); ++it) {
+                    if (it->engine == engine) {
+                        return &*it;
+                    }
+                }
+                return nullptr;
+            }
+        };
+
+        // Analyses the expansion of root up to the given depth. Lengths come
+        // from System::length(), which only stays cheap with pure materialisers;
+        // otherwise every generation is counted in full. The table compiled on
+        // the way is left in d0l, complete when the report is finite-state.
+        template <typename SYSTEM>
+        GrowthReport analyse_growth(SYSTEM &system, typename SYSTEM::TreeNode &root, unsigned int iterations,
+                                    D0LSystem<typename SYSTEM::TreeNode> &d0l, const CostModel &model = CostModel(),
+                                    size_t max_states = 4096) {
+            using TreeNode = typename SYSTEM::TreeNode;
+            GrowthReport report;
+
+            report.finite_state = compile_d0l(system, root, max_states, d0l);
+            if (report.finite_state) {
+                report.states = d0l.size();
+                report.growth_rate = d0l.growth_rate();
+                for (Symbol s = 0; s < d0l.size(); ++s) {
+                    report.max_branching = max(report.max_branching, d0l.successor_count(s));
+                }
+                for (unsigned int d = 0; d <= iterations; ++d) {
+                    report.lengths.push_back(d0l.length(d0l.root(), d));
+                }
+            } else {
+                report.max_branching = system.max_branching();
+                for (unsigned int d = 0; d <= iterations; ++d) {
+                    report.lengths.push_back(system.length(root, d));
+                }
+
+                double log_growth = 0.0;
+                unsigned int ratios = 0;
+                for (unsigned int d = iterations; d > 0 && ratios < 4 && report.lengths[d - 1] > 0; --d, ++ratios) {
+                    log_growth += log(static_cast<double>(report.lengths[d]) / static_cast<double>(report.lengths[d - 1]));
+                }
+                report.growth_rate = ratios == 0 ? 0.0 : exp(log_growth / static_cast<double>(ratios));
+            }
+
+            double length = static_cast<double>(report.lengths.back());
+            unsigned long long depth = iterations;
+            unsigned long long node_size = sizeof(TreeNode);
+            unsigned long long level_size = report.max_branching * node_size;
+            for (auto engine : traversal_engines) {
+                if (engine == TraversalEngine::D0L && !report.finite_state) {
+                    continue;
+                }
+
+                double seconds = length * model.ns_per_symbol[static_cast<size_t>(engine)] * 1e-9;
+                unsigned long long bytes = 0;
+                switch (engine) {
+                case TraversalEngine::EAGER:
+                    bytes = 2 * report.lengths.back() * node_size;
+                    break;
+                case TraversalEngine::LAZY:
+                case TraversalEngine::FUSED:
+                    // Each live level holds an iterator with its successors, a
+                    // context and a registration.
+                    bytes = depth * (sizeof(NestedLazyIterator<TreeNode>) + level_size + 3 * node_size + sizeof(unsigned int));
+                    break;
+                case TraversalEngine::GENERATOR:
+                    bytes = sizeof(FusedLazyIterator<TreeNode>) + depth * (level_size + sizeof(vector<TreeNode>) + sizeof(size_t));
+                    break;
+                case TraversalEngine::BOUNDED:
+                    bytes = SYSTEM::bounded_expand_bytes(iterations);
+                    break;
+                case TraversalEngine::FOR_EACH:
+                    bytes = depth * (node_size + 8 * sizeof(void *));
+                    break;
+                case TraversalEngine::D0L:
+                    seconds += static_cast<double>(report.states * report.max_branching) * model.materialiser_call_ns * 1e-9;
+                    bytes = report.states * (node_size + sizeof(size_t) + report.max_branching * sizeof(Symbol)) +
+                        (depth + 1) * (sizeof(Symbol) + sizeof(size_t));
+                    break;
+                }
+                report.costs.push_back(EngineCost(engine, seconds, bytes));
+            }
+
+            return report;
+        }
+
+        template <typename SYSTEM>
+        GrowthReport analyse_growth(SYSTEM &system, typename SYSTEM::TreeNode &root, unsigned int iterations,
+                                    const CostModel &model = CostModel(), size_t max_states = 4096) {
+            D0LSystem<typename SYSTEM::TreeNode> d0l;
+            return analyse_growth(system, root, iterations, d0l, model, max_states);
+        }
+
+        // Deepest generation, up to limit, whose length stays within
+        // max_symbols; for admission control before starting an expansion.
+        template <typename SYSTEM>
+        unsigned int deepest_within(SYSTEM &system, typename SYSTEM::TreeNode &root, unsigned long long max_symbols, unsigned int limit) {
+            unsigned int depth = 0;
+            while (depth < limit && system.length(root, depth + 1) <= max_symbols) {
+                ++depth;
+            }
+            return depth;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef __MODAL_LSYSTEM_SNAPSHOT__
+#define __MODAL_LSYSTEM_SNAPSHOT__
+
+#include <map>
+#include <memory>
+#include <utility>
+#include "bounded_iterator.hpp"
+#include "epoch.hpp"
+
+using namespace std;
+
+namespace trlsai {
+    namespace lsystem {
+        // A system seen through a pinned, immutable version of its rules; see
+        // System::pin_rules(). It has the lookup interface the traversal
+        // helpers use, so they run against the snapshot unchanged. Nodes are
+        // still produced by the system's materialiser.
+        template <typename SYSTEM>
+        class RuleSnapshot {
+        public:
+            using Key = typename SYSTEM::Key;
+            using TreeNode = typename SYSTEM::TreeNode;
+            using RuleList = typename SYSTEM::RuleList;
+            using Rules = typename SYSTEM::Rules;
+
+            RuleSnapshot(SYSTEM *system, shared_ptr<const Rules> rules): system(system), pinned(rules) { }
+
+            const Rules &rules() const {
+                return *this->pinned;
+            }
+
+            const RuleList *find_rule(const Key &key) const {
+                auto iter = this->pinned->find(key);
+                return iter == this->pinned->end() ? nullptr : &iter->second;
+            }
+
+            // The snapshot already keeps its rules alive.
+            const RuleList *find_rule(const Key &key, shared_ptr<const Rules> &) const {
+                return this->find_rule(key);
+            }
+
+            static size_t child_count(const RuleList *rule) {
+                return SYSTEM::child_count(rule);
+            }
+
+            bool has_pure_materialiser() {
+                return this->system->has_pure_materialiser();
+            }
+
+            // Pinned rules are never freed under a reader, so there's nothing to guard.
+            EpochGuard read_guard() {
+                return EpochGuard(nullptr);
+            }
+
+            TreeNode produce_child(TreeNode &parent, const RuleList *rule, size_t index) {
+                return this->system->produce_child(parent, rule, index);
+            }
+
+            // Like System::length(), with a table of its own since the rules
+            // never change.
+            unsigned long long length(TreeNode &original, unsigned int iterations) {
+                if (iterations == 0) {
+                    return 1;
+                }
+
+                bool cached = this->system->has_pure_materialiser();
+                if (cached) {
+                    auto known = this->lengths.find(make_pair(original, iterations));
+                    if (known != this->lengths.end()) {
+                        return known->second;
+                    }
+                }
+
+                unsigned long long total = 0;
+                const RuleList *rule = this->find_rule(original.key);
+                for (size_t j = 0; j < RuleSnapshot::child_count(rule); ++j) {
+                    TreeNode child = this->produce_child(original, rule, j);
+                    total += this->length(child, iterations - 1);
+                }
+
+                if (cached) {
+                    this->lengths[make_pair(original, iterations)] = total;
+                }
+                return total;
+            }
+
+        private:
+            SYSTEM *system;
+            shared_ptr<const Rules> pinned;
+            map<pair<TreeNode, unsigned int>, unsigned long long> lengths;
+        };
+
+        // Bounded traversal over a snapshot, keeping it alive. It isn't
+        // registered: updates made after the snapshot was taken never reach it.
+        template <typename SYSTEM>
+        class SnapshotIterator : public BoundedLazyIterator<RuleSnapshot<SYSTEM>> {
+        public:
+            using TreeNode = typename SYSTEM::TreeNode;
+
+            SnapshotIterator(shared_ptr<RuleSnapshot<SYSTEM>> snapshot, TreeNode &original, unsigned int iterations)
+                : BoundedLazyIterator<RuleSnapshot<SYSTEM>>(snapshot.get(), original, iterations), snapshot(snapshot) {
+            }
+
+        private:
+            shared_ptr<RuleSnapshot<SYSTEM>> snapshot;
+        };
+    }
+}
+
+#endif
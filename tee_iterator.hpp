@@ -0,0 +1,195 @@
+#ifndef __MODAL_LSYSTEM_TEE_ITERATOR__
+#define __MODAL_LSYSTEM_TEE_ITERATOR__
+
+#include <condition_variable>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "lazy_iterator.hpp"
+
+using namespace std;
+
+namespace trlsai {
+    namespace lsystem {
+        enum class TeeMode { SINGLE_THREAD, MULTI_THREAD };
+
+        // What a tee's consumers share: the source iterator and the chunks of
+        // it some consumer still has to read. A chunk is dropped once every
+        // consumer has moved past it, and freed when the last consumer still
+        // holding it moves on, so memory follows the gap between the slowest
+        // and the fastest consumer.
+        //
+        // With MULTI_THREAD, consumers on different threads only lock at chunk
+        // boundaries, and one that would need more than max_chunks buffered
+        // waits for the slowest to catch up. Every consumer has to be read or
+        // destroyed, or the others end up waiting for it forever. With
+        // SINGLE_THREAD nothing locks or waits, so max_chunks can't be
+        // enforced: reading consumers in turn keeps the buffer small, and
+        // buffered_chunks() shows how far apart they are.
+        template <typename T>
+        class TeeBuffer {
+        public:
+            using Chunk = shared_ptr<const vector<T>>;
+
+            TeeBuffer(shared_ptr<Iterator<T>> source, size_t consumers, TeeMode mode, size_t chunk_size, size_t max_chunks)
+                : source(source), positions(consumers, 0), mode(mode), chunk_size(chunk_size == 0 ? 1 : chunk_size),
+                  max_chunks(max_chunks == 0 ? 1 : max_chunks), base(0), end(0), finished(false) {
+            }
+
+            // Chunk holding element position, or nullptr past the end. The
+            // consumer is taken to be done with everything before position.
+            Chunk chunk_at(size_t consumer, unsigned long long position) {
+                unique_lock<mutex> guard = this->lock();
+                this->positions[consumer] = position;
+                this->release();
+
+                while (true) {
+                    if (position < this->end) {
+                        return this->chunks[static_cast<size_t>((position - this->base) / this->chunk_size)];
+                    }
+                    if (this->finished) {
+                        return nullptr;
+                    }
+                    if (this->mode == TeeMode::MULTI_THREAD && this->chunks.size() >= this->max_chunks) {
+                        this->released.wait(guard);
+                        continue;
+                    }
+                    this->fill();
+                }
+            }
+
+            // A consumer that's gone no longer holds anything back.
+            void leave(size_t consumer) {
+                unique_lock<mutex> guard = this->lock();
+                this->positions[consumer] = numeric_limits<unsigned long long>::max();
+                this->release();
+            }
+
+            size_t buffered_chunks() {
+                unique_lock<mutex> guard = this->lock();
+                return this->chunks.size();
+            }
+
+        private:
+            shared_ptr<Iterator<T>> source;
+            deque<Chunk> chunks;
+            vector<unsigned long long> positions;
+            TeeMode mode;
+            size_t chunk_size;
+            size_t max_chunks;
+            // Positions of the first buffered element and the one after the last.
+            unsigned long long base;
+            unsigned long long end;
+            bool finished;
+            mutex guard_lock;
+            condition_variable released;
+
+            unique_lock<mutex> lock() {
+                return this->mode == TeeMode::SINGLE_THREAD ? unique_lock<mutex>() : unique_lock<mutex>(this->guard_lock);
+            }
+
+            // Every chunk but the last is full, so a chunk's position follows
+            // from its index.
+            void fill() {
+                auto chunk = make_shared<vector<T>>();
+                chunk->reserve(this->chunk_size);
+                while (chunk->size() < this->chunk_size && this->source->has_next()) {
+                    chunk->push_back(this->source->next());
+                }
+                if (chunk->size() < this->chunk_size) {
+                    this->finished = true;
+                }
+                if (!chunk->empty()) {
+                    this->end += chunk->size();
+                    this->chunks.push_back(chunk);
+                }
+            }
+
+            void release() {
+                unsigned long long slowest = numeric_limits<unsigned long long>::max();
+                for (auto position = this->positions.begin(); position != this->positions.end(); ++position) {
+                    slowest = *position < slowest ? *position : slowest;
+                }
+
+                bool dropped = false;
+                while (!this->chunks.empty() && this->base + this->chunks.front()->size() <= slowest) {
+                    this->base += this->chunks.front()->size();
+                    this->chunks.pop_front();
+                    dropped = true;
+                }
+                if (dropped && this->mode == TeeMode::MULTI_THREAD) {
+                    this->released.notify_all();
+                }
+            }
+        };
+
+        // One consumer of a tee, reading the whole source from the start
+        // independently of the others; see TeeBuffer. Each consumer belongs to
+        // a single thread.
+        template <typename T>
+        class TeeIterator : public Iterator<T> {
+        public:
+            TeeIterator(shared_ptr<TeeBuffer<T>> buffer, size_t consumer)
+                : Iterator<T>(), buffer(buffer), consumer(consumer), start(0), offset(0), ended(false) {
+            }
+
+            TeeIterator(const TeeIterator &) = delete;
+            TeeIterator &operator=(const TeeIterator &) = delete;
+
+            ~TeeIterator() {
+                this->buffer->leave(this->consumer);
+            }
+
+            bool has_next() override {
+                while (!this->ended && (!this->chunk || this->offset == this->chunk->size())) {
+                    if (this->chunk) {
+                        this->start += this->chunk->size();
+                    }
+                    this->chunk = this->buffer->chunk_at(this->consumer, this->start);
+                    this->offset = 0;
+                    this->ended = !this->chunk;
+                }
+                return !this->ended;
+            }
+
+            // Elements are copied out, so nothing a consumer does to them
+            // reaches the others.
+            T &next() override {
+                this->has_next();
+                this->current = (*this->chunk)[this->offset++];
+                return this->current;
+            }
+
+            size_t buffered_chunks() {
+                return this->buffer->buffered_chunks();
+            }
+
+        private:
+            shared_ptr<TeeBuffer<T>> buffer;
+            size_t consumer;
+            typename TeeBuffer<T>::Chunk chunk;
+            unsigned long long start;
+            size_t offset;
+            bool ended;
+            T current;
+        };
+
+        // Splits source into the given number of consumers that all see its
+        // whole sequence while it's only read once.
+        template <typename T>
+        vector<shared_ptr<Iterator<T>>> tee(shared_ptr<Iterator<T>> source, size_t consumers,
+                                            TeeMode mode = TeeMode::SINGLE_THREAD,
+                                            size_t chunk_size = 1024, size_t max_chunks = 16) {
+            auto buffer = make_shared<TeeBuffer<T>>(source, consumers, mode, chunk_size, max_chunks);
+            vector<shared_ptr<Iterator<T>>> result;
+            for (size_t j = 0; j < consumers; ++j) {
+                result.push_back(make_shared<TeeIterator<T>>(buffer, j));
+            }
+            return result;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef __MODAL_LSYSTEM_TEST_FIXTURES__
+#define __MODAL_LSYSTEM_TEST_FIXTURES__
+
+#include <memory>
+#include <vector>
+#include "../lsystem.hpp"
+#include "../modulo_int_system.hpp"
+
+using namespace trlsai::lsystem;
+
+// Tests check the counters directly, without asking whether they're kept.
+static_assert(instrumentation_enabled(), "tests must be built with LSYSTEM_INSTRUMENTATION");
+
+using IntSystem = System<int, trlsai::lsystem::empty, int>;
+
+// Rules the tests expand with the modulo materialiser over [-3, 4]. Every key
+// the materialiser can produce from them stays within that range, so systems
+// using them are finite-state.
+inline shared_ptr<IntSystem::Rules> sample_rules() {
+    auto rules = make_shared<IntSystem::Rules>();
+    (*rules)[1] = { 1, 2, 3 };
+    (*rules)[2] = { 3, -1 };
+    (*rules)[3] = { 1, 4, 3 };
+    (*rules)[-1] = { 3, -3 };
+    (*rules)[-3] = { 2, -3 };
+    return rules;
+}
+
+inline vector<int> drain(shared_ptr<Iterator<IntSystem::TreeNode>> it) {
+    vector<int> keys;
+    while (it->has_next()) {
+        keys.push_back(it->next().key);
+    }
+    return keys;
+}
+
+inline vector<int> keys_of(const vector<IntSystem::TreeNode> &nodes) {
+    vector<int> keys;
+    for (auto it = nodes.begin(); it != nodes.end(); ++it) {
+        keys.push_back(it->key);
+    }
+    return keys;
+}
+
+#endif
@@ -0,0 +1,268 @@
+#include <thread>
+#include "../catch/catch.hpp"
+#include "fixtures.hpp"
+
+TEST_CASE("Concurrent updates reach registered iterators through their mailbox", "[concurrency]") {
+    auto rules = sample_rules();
+    IntSystem system(make_shared<IntSystem::Rules>(), make_shared<ModuloIntMaterialiser>(-3, 4));
+    system.enable_concurrency();
+    REQUIRE(system.concurrent());
+
+    IntSystem::TreeNode original(1, 1);
+    auto it = system.lazy_expand(original, 5);
+    system.update_rules(*rules);
+
+    IntSystem reference(rules, make_shared<ModuloIntMaterialiser>(-3, 4));
+    REQUIRE(drain(it) == keys_of(reference.expand(original, 5)));
+}
+
+TEST_CASE("Traversals on several threads run alongside rule updates", "[concurrency]") {
+    auto rules = sample_rules();
+    IntSystem system(rules, make_shared<ModuloIntMaterialiser>(-3, 4));
+    system.enable_concurrency();
+
+    IntSystem::TreeNode original(1, 1);
+    IntSystem reference(sample_rules(), make_shared<ModuloIntMaterialiser>(-3, 4));
+    vector<int> expected;
+    reference.for_each(original, 9, [&expected](IntSystem::TreeNode &node) {
+        expected.push_back(node.key);
+        return true;
+    });
+
+    const int readers = 4;
+    vector<vector<int>> results(readers);
+    vector<thread> threads;
+    for (int j = 0; j < readers; ++j) {
+        threads.push_back(thread([&system, &results, original, j]() mutable {
+            for (int round = 0; round < 3; ++round) {
+                results[static_cast<size_t>(j)] = drain(system.lazy_expand(original, 9));
+            }
+        }));
+    }
+
+    // Rewriting a rule with its own value keeps the expansion the same, while
+    // still publishing new rules and refreshing registrations.
+    auto rule = (*sample_rules())[3];
+    for (int j = 0; j < 200; ++j) {
+        system.update_rule(3, rule);
+    }
+
+    for (auto thread = threads.begin(); thread != threads.end(); ++thread) {
+        thread->join();
+    }
+    for (int j = 0; j < readers; ++j) {
+        REQUIRE(results[static_cast<size_t>(j)] == expected);
+    }
+    REQUIRE(system.length(original, 9) == expected.size());
+}
+
+TEST_CASE("Live bounded iterators don't hold back retired rules they never read", "[concurrency]") {
+    IntSystem system(sample_rules(), make_shared<ModuloIntMaterialiser>(-3, 4));
+    system.enable_concurrency();
+    IntSystem::TreeNode original(1, 1);
+    vector<int> expected = keys_of(system.expand(original, 7));
+
+    // More than the epoch domain has slots for.
+    vector<shared_ptr<Iterator<IntSystem::TreeNode>>> iterators;
+    for (size_t j = 0; j < EpochDomain::slot_count + 10; ++j) {
+        iterators.push_back(system.bounded_expand(original, 7));
+        iterators.back()->next();
+    }
+
+    auto rule = (*sample_rules())[3];
+    system.update_rule(3, { 3, 1 });
+    weak_ptr<const IntSystem::Rules> intermediate = system.pin_rules();
+    system.update_rule(3, rule);
+    REQUIRE(intermediate.expired());
+
+    for (auto it = iterators.begin(); it != iterators.end(); ++it) {
+        REQUIRE(drain(*it) == vector<int>(expected.begin() + 1, expected.end()));
+    }
+}
+
+TEST_CASE("Prefetching iterators yield the whole expansion in order", "[concurrency]") {
+    IntSystem system(sample_rules(), make_shared<ModuloIntMaterialiser>(-3, 4));
+    IntSystem::TreeNode original(1, 1);
+    auto expected = system.expand(original, 9);
+
+    auto it = system.prefetch_expand(original, 9, 5);
+    vector<int> keys;
+    while (it->has_next()) {
+        keys.push_back(it->next().key);
+    }
+    REQUIRE(keys.size() == expected.size());
+    for (size_t j = 0; j < keys.size(); ++j) {
+        REQUIRE(keys[j] == expected[j].key);
+    }
+
+    PrefetchIterator<IntSystem::TreeNode> batched(system.bounded_expand(original, 9), 100);
+    REQUIRE(batched.capacity() == 128);
+    vector<IntSystem::TreeNode> batch(64);
+    size_t total = 0;
+    while (batched.has_next()) {
+        size_t taken = batched.next_batch(batch.data(), batch.size());
+        for (size_t j = 0; j < taken; ++j) {
+            REQUIRE(batch[j].key == expected[total + j].key);
+        }
+        total += taken;
+    }
+    REQUIRE(total == expected.size());
+
+    // Dropping an unfinished prefetch stops its producer.
+    auto abandoned = system.prefetch_expand(original, 12, 16);
+    REQUIRE(abandoned->has_next());
+    abandoned = nullptr;
+}
+
+TEST_CASE("Threaded tees feed consumers on their own threads", "[concurrency]") {
+    IntSystem system(sample_rules(), make_shared<ModuloIntMaterialiser>(-3, 4));
+    IntSystem::TreeNode original(1, 1);
+    vector<int> expected_keys = keys_of(system.expand(original, 9));
+
+    auto consumers = system.tee_expand(original, 9, 4, TeeMode::MULTI_THREAD, 32, 4);
+    vector<vector<int>> keys(consumers.size());
+    vector<size_t> most_buffered(consumers.size(), 0);
+    vector<thread> threads;
+    for (size_t j = 0; j < consumers.size(); ++j) {
+        threads.push_back(thread([&consumers, &keys, &most_buffered, j]() {
+            auto consumer = static_pointer_cast<TeeIterator<IntSystem::TreeNode>>(consumers[j]);
+            while (consumer->has_next()) {
+                keys[j].push_back(consumer->next().key);
+                if (j == 0) {
+                    this_thread::yield();
+                }
+                most_buffered[j] = max(most_buffered[j], consumer->buffered_chunks());
+            }
+        }));
+    }
+    for (auto t = threads.begin(); t != threads.end(); ++t) {
+        t->join();
+    }
+
+    for (size_t j = 0; j < consumers.size(); ++j) {
+        REQUIRE(keys[j] == expected_keys);
+        REQUIRE(most_buffered[j] <= 4);
+    }
+}
+
+struct CountVisitor : public TraversalVisitor<IntSystem::TreeNode> {
+    CountVisitor(): count(0) { }
+
+    bool visit(IntSystem::TreeNode &) {
+        ++this->count;
+        return true;
+    }
+
+    unsigned long long count;
+};
+
+struct CountMonoid {
+    using Result = unsigned long long;
+
+    Result identity() const {
+        return 0;
+    }
+
+    Result lift(const IntSystem::TreeNode &) const {
+        return 1;
+    }
+
+    Result combine(const Result &left, const Result &right) const {
+        return left + right;
+    }
+};
+
+TEST_CASE("Traversals holding rule pointers run under a continuous writer", "[concurrency]") {
+    IntSystem system(sample_rules(), make_shared<ModuloIntMaterialiser>(-3, 4));
+    system.enable_concurrency();
+    IntSystem::TreeNode original(1, 1);
+    unsigned long long expected = system.length(original, 15);
+    unsigned long long expected_threes = system.histogram(original, 15).keys[3];
+
+    // Every result of each round, which should all be the expected length.
+    vector<unsigned long long> counts;
+    vector<unsigned long long> threes;
+    atomic<bool> reading(true);
+    thread reader([&]() {
+        for (int round = 0; round < 4; ++round) {
+            unsigned long long visited = 0;
+            system.for_each(original, 15, [&visited](IntSystem::TreeNode &) {
+                ++visited;
+                return true;
+            });
+            counts.push_back(visited);
+
+            CountVisitor visitor;
+            system.traverse(original, 15, visitor);
+            counts.push_back(visitor.count);
+            counts.push_back(system.reduce(original, 15, CountMonoid()));
+            counts.push_back(drain(system.bounded_expand(original, 15)).size());
+            threes.push_back(system.histogram(original, 15).keys[3]);
+            threes.push_back(drain(system.filtered_expand(original, 15, { 3 })).size());
+        }
+        reading.store(false);
+    });
+
+    // The same rule again, so every round sees the same expansion while the
+    // rules it reads are retired under it.
+    auto rule = (*sample_rules())[3];
+    while (reading.load()) {
+        system.update_rule(3, rule);
+    }
+    reader.join();
+
+    REQUIRE(counts.size() == 16);
+    for (auto count = counts.begin(); count != counts.end(); ++count) {
+        REQUIRE(*count == expected);
+    }
+    for (auto count = threes.begin(); count != threes.end(); ++count) {
+        REQUIRE(*count == expected_threes);
+    }
+}
+
+TEST_CASE("Deferred updates published under spinning readers are never missed", "[concurrency]") {
+    IntSystem system(sample_rules(), make_shared<ModuloIntMaterialiser>(-3, 4));
+    system.enable_concurrency();
+    system.set_deferred_updates(true);
+    IntSystem::TreeNode original(1, 1);
+
+    // Readers keep checking their iterators while each update is published,
+    // so some of them look at the version as soon as it moves.
+    vector<IntSystem::RuleList> alternatives = { { 1, 2, 3 }, { 2, 3 }, { 3, 1, 1, 2 } };
+    const size_t readers = 4;
+    for (size_t round = 0; round < 200; ++round) {
+        const IntSystem::RuleList &rule = alternatives[round % alternatives.size()];
+        IntSystem reference(sample_rules(), make_shared<ModuloIntMaterialiser>(-3, 4));
+        reference.update_rule(1, rule);
+        vector<int> expected = drain(reference.lazy_expand(original, 1));
+
+        vector<shared_ptr<Iterator<IntSystem::TreeNode>>> iterators;
+        for (size_t j = 0; j < readers; ++j) {
+            iterators.push_back(system.lazy_expand(original, 1));
+        }
+
+        atomic<bool> updated(false);
+        atomic<size_t> spinning(0);
+        vector<thread> threads;
+        for (size_t j = 0; j < readers; ++j) {
+            threads.push_back(thread([&iterators, &updated, &spinning, j]() {
+                ++spinning;
+                while (!updated.load()) {
+                    iterators[j]->has_next();
+                }
+            }));
+        }
+        while (spinning.load() < readers) {
+            this_thread::yield();
+        }
+        system.update_rule(1, rule);
+        updated.store(true);
+        for (auto t = threads.begin(); t != threads.end(); ++t) {
+            t->join();
+        }
+
+        for (size_t j = 0; j < readers; ++j) {
+            REQUIRE(drain(iterators[j]) == expected);
+        }
+    }
+}
@@ -0,0 +1,81 @@
+#include "../catch/catch.hpp"
+#include "fixtures.hpp"
+
+using IntDurationSystem = System<int, Duration, ModuloValue>;
+
+TEST_CASE("Modulo systems compile to a finite D0L table", "[d0l]") {
+    IntSystem system(sample_rules(), make_shared<ModuloIntMaterialiser>(-3, 4));
+    IntSystem::TreeNode original(1, 1);
+    D0LSystem<IntSystem::TreeNode> d0l;
+
+    REQUIRE(compile_d0l(system, original, 64, d0l));
+    REQUIRE(d0l.size() <= 9);
+
+    for (unsigned int iterations = 0; iterations <= 8; ++iterations) {
+        auto expected = system.expand(original, static_cast<int>(iterations));
+
+        vector<Symbol> eager;
+        d0l.expand(d0l.root(), iterations, eager);
+        REQUIRE(eager.size() == expected.size());
+        REQUIRE(d0l.length(d0l.root(), iterations) == expected.size());
+
+        auto it = d0l.lazy_expand(d0l.root(), iterations);
+        size_t index = 0;
+        while (it->has_next()) {
+            Symbol symbol = it->next();
+            REQUIRE(index < expected.size());
+            REQUIRE(symbol == eager[index]);
+            REQUIRE(d0l.node(symbol).key == expected[index].key);
+            REQUIRE(d0l.node(symbol).value == expected[index].value);
+            ++index;
+        }
+        REQUIRE(index == expected.size());
+    }
+}
+
+TEST_CASE("D0L iterators skip to the same position as stepping", "[d0l]") {
+    IntSystem system(sample_rules(), make_shared<ModuloIntMaterialiser>(-3, 4));
+    IntSystem::TreeNode original(1, 1);
+    D0LSystem<IntSystem::TreeNode> d0l;
+    REQUIRE(compile_d0l(system, original, 64, d0l));
+
+    vector<Symbol> eager;
+    d0l.expand(d0l.root(), 9, eager);
+    for (unsigned long long n : { 0ULL, 1ULL, 2ULL, 17ULL, 100ULL, 500ULL, static_cast<unsigned long long>(eager.size()), 100000ULL }) {
+        auto it = d0l.lazy_expand(d0l.root(), 9);
+        unsigned long long skipped = it->advance(n);
+        REQUIRE(skipped == min(n, static_cast<unsigned long long>(eager.size())));
+        vector<Symbol> rest;
+        while (it->has_next()) {
+            rest.push_back(it->next());
+        }
+        REQUIRE(rest == vector<Symbol>(eager.begin() + static_cast<long>(skipped), eager.end()));
+    }
+
+    auto it = d0l.lazy_expand(d0l.root(), 9);
+    it->advance(3);
+    it->next();
+    it->advance(40);
+    REQUIRE(it->next() == eager[44]);
+
+    // Deep enough that stepping wouldn't finish.
+    unsigned long long total = d0l.length(d0l.root(), 60);
+    it = d0l.lazy_expand(d0l.root(), 60);
+    REQUIRE(it->advance(total - 1) == total - 1);
+    REQUIRE(it->has_next());
+    it->next();
+    REQUIRE_FALSE(it->has_next());
+}
+
+TEST_CASE("Compiling stops when the reachable states exceed the limit", "[d0l]") {
+    using R = RuleNode<int, Duration>;
+    auto rules = make_shared<IntDurationSystem::Rules>();
+    (*rules)[1] = { R(1, 1), R(2, Duration(1, 2)) };
+    (*rules)[2] = { R(3, Duration(1, 5)) };
+
+    IntDurationSystem system(rules, make_shared<ModuloDurationMaterialiser>(-3, 4));
+    IntDurationSystem::TreeNode original(1, Duration(1), ModuloValue(1, Duration(1)));
+    D0LSystem<IntDurationSystem::TreeNode> d0l;
+
+    REQUIRE_FALSE(compile_d0l(system, original, 100, d0l));
+}
@@ -0,0 +1,764 @@
+#include "../catch/catch.hpp"
+#include "fixtures.hpp"
+
+TEST_CASE("Fused leaf levels produce the same sequence as eager expansion", "[lsystem]") {
+    IntSystem system(sample_rules(), make_shared<ModuloIntMaterialiser>(-3, 4));
+    IntSystem::TreeNode original(1, 1);
+    auto expected = keys_of(system.expand(original, 7));
+
+    for (unsigned int depth = 1; depth <= 9; ++depth) {
+        system.set_leaf_fusion_depth(depth);
+        REQUIRE(drain(system.lazy_expand(original, 7)) == expected);
+    }
+}
+
+TEST_CASE("Fused leaf levels pick up rule updates for unexpanded nodes", "[lsystem]") {
+    auto rules = sample_rules();
+    IntSystem lazy_system(make_shared<IntSystem::Rules>(), make_shared<ModuloIntMaterialiser>(-3, 4));
+    lazy_system.set_leaf_fusion_depth(3);
+    IntSystem::TreeNode original(1, 1);
+    auto it = lazy_system.lazy_expand(original, 5);
+
+    for (auto rule = rules->begin(); rule != rules->end(); ++rule) {
+        lazy_system.update_rule(rule->first, rule->second);
+    }
+
+    IntSystem system(rules, make_shared<ModuloIntMaterialiser>(-3, 4));
+    REQUIRE(drain(it) == keys_of(system.expand(original, 5)));
+}
+
+TEST_CASE("Batched rule updates re-expand each registration once", "[lsystem]") {
+    auto rules = sample_rules();
+    IntSystem lazy_system(make_shared<IntSystem::Rules>(), make_shared<ModuloIntMaterialiser>(-3, 4));
+    IntSystem::TreeNode original(1, 1);
+    auto it = lazy_system.lazy_expand(original, 5);
+
+    unsigned long version = lazy_system.rules_version();
+    lazy_system.reset_stats();
+    lazy_system.update_rules(*rules);
+    REQUIRE(lazy_system.rules_version() == version + 1);
+    REQUIRE(lazy_system.stats().rule_lookups == 1);
+    REQUIRE(lazy_system.stats().materialiser_calls == (*rules)[1].size());
+
+    IntSystem system(rules, make_shared<ModuloIntMaterialiser>(-3, 4));
+    REQUIRE(drain(it) == keys_of(system.expand(original, 5)));
+}
+
+TEST_CASE("Instrumentation counts iterators, registrations and materialiser calls", "[lsystem]") {
+    IntSystem system(sample_rules(), make_shared<ModuloIntMaterialiser>(-3, 4));
+    IntSystem::TreeNode original(1, 1);
+
+    system.expand(original, 1);
+    SystemStats stats = system.stats();
+    REQUIRE(stats.rule_lookups == 1);
+    REQUIRE(stats.materialiser_calls == 3);
+    REQUIRE(stats.nodes_produced == 3);
+    REQUIRE(stats.bytes_allocated >= 3 * sizeof(IntSystem::TreeNode));
+
+    system.reset_stats();
+    REQUIRE(system.stats().materialiser_calls == 0);
+
+    drain(system.lazy_expand(original, 6));
+    system.compact_registrations();
+    stats = system.stats();
+    REQUIRE(stats.iterators_created > 1);
+    REQUIRE(stats.registrations_added == stats.registrations_removed);
+    REQUIRE(stats.iterators_destroyed == stats.iterators_created);
+}
+
+TEST_CASE("Registrations don't outlive their iterators", "[lsystem]") {
+    IntSystem system(sample_rules(), make_shared<ModuloIntMaterialiser>(-3, 4));
+    IntSystem::TreeNode original(1, 1);
+
+    for (int j = 0; j < 100; ++j) {
+        auto it = system.lazy_expand(original, 8);
+        it->next();
+        it->next();
+    }
+    // Registering sweeps dead entries before a key's vector grows, so
+    // abandoned traversals can't pile up.
+    REQUIRE(system.registration_count() < 100 * 8);
+
+    auto live = system.lazy_expand(original, 8);
+    live->next();
+    system.compact_registrations();
+    REQUIRE(system.registration_count() > 0);
+    REQUIRE(system.registration_count() <= 8);
+
+    live = nullptr;
+    system.compact_registrations();
+    REQUIRE(system.registration_count() == 0);
+    REQUIRE(system.stats().iterators_destroyed == system.stats().iterators_created);
+}
+
+TEST_CASE("Generator produces the same sequence as eager expansion", "[lsystem]") {
+    IntSystem system(sample_rules(), make_shared<ModuloIntMaterialiser>(-3, 4));
+    IntSystem::TreeNode original(1, 1);
+
+    for (int iterations = 0; iterations <= 8; ++iterations) {
+        REQUIRE(drain(system.generate(original, static_cast<unsigned int>(iterations))) == keys_of(system.expand(original, iterations)));
+    }
+}
+
+TEST_CASE("Bounded traversal matches eager expansion in the memory it reports", "[lsystem]") {
+    auto rules = sample_rules();
+    (*rules)[4] = { };
+    IntSystem system(rules, make_shared<ModuloIntMaterialiser>(-3, 4));
+    IntSystem::TreeNode original(1, 1);
+
+    for (unsigned int iterations = 0; iterations <= 8; ++iterations) {
+        auto it = system.bounded_expand(original, iterations);
+        REQUIRE(drain(it) == keys_of(system.expand(original, static_cast<int>(iterations))));
+
+        auto bounded = static_pointer_cast<BoundedLazyIterator<IntSystem>>(it);
+        REQUIRE(bounded->allocated_bytes() == IntSystem::bounded_expand_bytes(iterations));
+    }
+}
+
+TEST_CASE("for_each visits the expansion in order and can stop early", "[lsystem]") {
+    IntSystem system(sample_rules(), make_shared<ModuloIntMaterialiser>(-3, 4));
+    IntSystem::TreeNode original(1, 1);
+
+    for (unsigned int iterations = 0; iterations <= 8; ++iterations) {
+        vector<int> keys;
+        REQUIRE(system.for_each(original, iterations, [&keys](IntSystem::TreeNode &node) {
+            keys.push_back(node.key);
+            return true;
+        }));
+        REQUIRE(keys == keys_of(system.expand(original, static_cast<int>(iterations))));
+    }
+
+    vector<int> prefix;
+    REQUIRE_FALSE(system.for_each(original, 8, [&prefix](IntSystem::TreeNode &node) {
+        prefix.push_back(node.key);
+        return prefix.size() < 10;
+    }));
+    auto expected = keys_of(system.expand(original, 8));
+    REQUIRE(prefix == vector<int>(expected.begin(), expected.begin() + 10));
+}
+
+struct SkipKeyVisitor : public TraversalVisitor<IntSystem::TreeNode> {
+    SkipKeyVisitor(int skipped_key): skipped_key(skipped_key), visited(0), skipped(0), subtrees(0) { }
+
+    Descent enter(IntSystem::TreeNode &node, unsigned int) {
+        return node.key == this->skipped_key ? Descent::SKIP : Descent::DESCEND;
+    }
+
+    bool visit(IntSystem::TreeNode &) {
+        ++this->visited;
+        return true;
+    }
+
+    void skip(IntSystem::TreeNode &, unsigned int, unsigned long long length) {
+        this->skipped += length;
+        ++this->subtrees;
+    }
+
+    int skipped_key;
+    unsigned long long visited;
+    unsigned long long skipped;
+    unsigned long long subtrees;
+};
+
+TEST_CASE("traverse skips subtrees and reports their length", "[lsystem]") {
+    IntSystem system(sample_rules(), make_shared<ModuloIntMaterialiser>(-3, 4));
+    IntSystem::TreeNode original(1, 1);
+
+    for (int iterations = 0; iterations <= 10; ++iterations) {
+        unsigned long long total = system.expand(original, iterations).size();
+        REQUIRE(system.length(original, static_cast<unsigned int>(iterations)) == total);
+
+        SkipKeyVisitor visitor(3);
+        REQUIRE(system.traverse(original, static_cast<unsigned int>(iterations), visitor));
+        REQUIRE(visitor.visited + visitor.skipped == total);
+        if (iterations > 2) {
+            REQUIRE(visitor.subtrees > 0);
+        }
+    }
+
+    unsigned long long length = system.length(original, 20);
+    system.reset_stats();
+    SkipKeyVisitor visitor(1);
+    system.traverse(original, 20, visitor);
+    REQUIRE(visitor.visited == 0);
+    REQUIRE(visitor.skipped == length);
+    REQUIRE(system.stats().materialiser_calls == 0);
+}
+
+TEST_CASE("Length tables are invalidated by rule updates", "[lsystem]") {
+    IntSystem system(sample_rules(), make_shared<ModuloIntMaterialiser>(-3, 4));
+    IntSystem::TreeNode original(1, 1);
+
+    system.length(original, 6);
+    system.update_rule(3, { 3 });
+    REQUIRE(system.length(original, 6) == system.expand(original, 6).size());
+}
+
+TEST_CASE("Filtered expansion yields only the wanted keys without visiting dead subtrees", "[lsystem]") {
+    auto rules = sample_rules();
+    (*rules)[0] = { 0 };
+    (*rules)[4] = { 4 };
+    IntSystem system(rules, make_shared<ModuloIntMaterialiser>(-3, 4));
+    IntSystem::TreeNode original(1, 1);
+
+    for (int target = -3; target <= 4; ++target) {
+        vector<int> expected;
+        for (auto key : keys_of(system.expand(original, 8))) {
+            if (key == target) {
+                expected.push_back(key);
+            }
+        }
+        REQUIRE(drain(system.filtered_expand(original, 8, { target })) == expected);
+    }
+
+    IntSystem::TreeNode stuck(0, 0);
+    system.reset_stats();
+    REQUIRE(drain(system.filtered_expand(stuck, 12, { 1 })).empty());
+    REQUIRE(system.stats().materialiser_calls <= 12);
+}
+
+TEST_CASE("advance skips to the same position as stepping", "[lsystem]") {
+    IntSystem system(sample_rules(), make_shared<ModuloIntMaterialiser>(-3, 4));
+    IntSystem::TreeNode original(1, 1);
+    auto expected = keys_of(system.expand(original, 9));
+
+    vector<function<shared_ptr<Iterator<IntSystem::TreeNode>>()>> engines = {
+        [&]() { system.set_leaf_fusion_depth(1); return system.lazy_expand(original, 9); },
+        [&]() { system.set_leaf_fusion_depth(4); return system.lazy_expand(original, 9); },
+        [&]() { return system.generate(original, 9); },
+        [&]() { return system.bounded_expand(original, 9); },
+    };
+
+    for (auto engine = engines.begin(); engine != engines.end(); ++engine) {
+        for (unsigned long long n : { 0ULL, 1ULL, 2ULL, 17ULL, 100ULL, 500ULL, static_cast<unsigned long long>(expected.size()), 100000ULL }) {
+            auto it = (*engine)();
+            unsigned long long skipped = it->advance(n);
+            REQUIRE(skipped == min(n, static_cast<unsigned long long>(expected.size())));
+            REQUIRE(drain(it) == vector<int>(expected.begin() + static_cast<long>(skipped), expected.end()));
+        }
+
+        auto it = (*engine)();
+        it->advance(3);
+        it->next();
+        it->advance(40);
+        REQUIRE(it->next().key == expected[44]);
+    }
+}
+
+// Numbers nodes in the order they're produced, so skipping a subtree
+// without producing it would show in every value after it.
+class CallOrderMaterialiser : public Materialiser<int, trlsai::lsystem::empty, int> {
+public:
+    CallOrderMaterialiser(): calls(0) { }
+
+    IntSystem::TreeNode produce(const int &key, const trlsai::lsystem::empty &, const IntSystem::TreeNode &, unsigned int) override {
+        return IntSystem::TreeNode(key, ++this->calls);
+    }
+
+    int calls;
+};
+
+TEST_CASE("advance with an impure materialiser produces the nodes stepping would", "[lsystem]") {
+    IntSystem::TreeNode original(1, 1);
+    auto stepping = make_shared<CallOrderMaterialiser>();
+    IntSystem reference(sample_rules(), stepping);
+    auto expected = reference.bounded_expand(original, 6);
+    for (int j = 0; j < 50; ++j) {
+        expected->next();
+    }
+    int value = expected->next().value;
+
+    auto skipping = make_shared<CallOrderMaterialiser>();
+    IntSystem system(sample_rules(), skipping);
+    vector<function<shared_ptr<Iterator<IntSystem::TreeNode>>()>> engines = {
+        [&]() { return system.bounded_expand(original, 6); },
+        [&]() { return system.lazy_expand(original, 6, Isolation::SNAPSHOT); },
+    };
+    for (auto engine = engines.begin(); engine != engines.end(); ++engine) {
+        skipping->calls = 0;
+        auto it = (*engine)();
+        REQUIRE(it->advance(50) == 50);
+        REQUIRE(it->next().value == value);
+        REQUIRE(skipping->calls == stepping->calls);
+    }
+}
+
+TEST_CASE("advance doesn't expand skipped subtrees", "[lsystem]") {
+    IntSystem system(sample_rules(), make_shared<ModuloIntMaterialiser>(-3, 4));
+    IntSystem::TreeNode original(1, 1);
+    unsigned long long total = system.length(original, 24);
+
+    system.reset_stats();
+    auto it = system.bounded_expand(original, 24);
+    REQUIRE(it->advance(total - 1) == total - 1);
+    REQUIRE(it->has_next());
+    REQUIRE(system.stats().materialiser_calls < 200);
+}
+
+TEST_CASE("Growth analysis reports exact lengths and the dominant growth rate", "[lsystem]") {
+    auto rules = make_shared<IntSystem::Rules>();
+    (*rules)[0] = { 0, 0 };
+    IntSystem doubling(rules, make_shared<ModuloIntMaterialiser>(0, 4));
+    IntSystem::TreeNode zero(0, 0);
+
+    GrowthReport report = analyse_growth(doubling, zero, 10);
+    REQUIRE(report.finite_state);
+    REQUIRE(report.states == 1);
+    REQUIRE(report.growth_rate == Approx(2.0));
+    REQUIRE(report.lengths.back() == 1024);
+    REQUIRE(report.cost(TraversalEngine::D0L) != nullptr);
+    REQUIRE(deepest_within(doubling, zero, 1000, 20) == 9);
+
+    IntSystem system(sample_rules(), make_shared<ModuloIntMaterialiser>(-3, 4));
+    IntSystem::TreeNode original(1, 1);
+    report = analyse_growth(system, original, 30);
+    for (unsigned int d = 0; d <= 8; ++d) {
+        REQUIRE(report.lengths[d] == system.expand(original, static_cast<int>(d)).size());
+    }
+    double ratio = static_cast<double>(report.lengths[30]) / static_cast<double>(report.lengths[29]);
+    REQUIRE(report.growth_rate == Approx(ratio).epsilon(0.01));
+    REQUIRE(report.cost(TraversalEngine::BOUNDED)->bytes == IntSystem::bounded_expand_bytes(30));
+    REQUIRE(report.cost(TraversalEngine::LAZY)->seconds > report.cost(TraversalEngine::FOR_EACH)->seconds);
+}
+
+TEST_CASE("The planner picks an engine that meets the requirements", "[lsystem]") {
+    IntSystem system(sample_rules(), make_shared<ModuloIntMaterialiser>(-3, 4));
+    IntSystem::TreeNode original(1, 1);
+    auto expected = keys_of(system.expand(original, 8));
+
+    auto plan = system.plan(original, 8);
+    REQUIRE(plan.engine == TraversalEngine::D0L);
+    REQUIRE(plan.report.lengths.back() == expected.size());
+    REQUIRE(plan.describe().find("engine=d0l") == 0);
+    REQUIRE(drain(system.open(plan)) == expected);
+
+    PlanRequirements requirements;
+    requirements.live_updates = true;
+    plan = system.plan(original, 8, requirements);
+    REQUIRE(plan.engine == TraversalEngine::LAZY);
+    REQUIRE(plan.estimated_seconds == plan.report.cost(TraversalEngine::LAZY)->seconds);
+    REQUIRE(plan.estimated_seconds > 0);
+
+    IntSystem impure(sample_rules(), make_shared<CallOrderMaterialiser>());
+    auto untimed = impure.plan(original, 8);
+    REQUIRE(untimed.engine == TraversalEngine::BOUNDED);
+    REQUIRE(untimed.describe().find("estimated_seconds=unknown") != string::npos);
+
+    requirements = PlanRequirements();
+    requirements.max_bytes = IntSystem::bounded_expand_bytes(8);
+    plan = system.plan(original, 8, requirements);
+    REQUIRE(plan.estimated_bytes <= requirements.max_bytes);
+    REQUIRE(plan.engine != TraversalEngine::EAGER);
+
+    requirements.max_bytes = 1;
+    requirements.push_style = true;
+    plan = system.plan(original, 8, requirements);
+    for (auto cost = plan.report.costs.begin(); cost != plan.report.costs.end(); ++cost) {
+        REQUIRE(plan.estimated_bytes <= cost->bytes);
+    }
+
+    vector<int> keys;
+    REQUIRE(system.execute(plan, [&keys](IntSystem::TreeNode &node) {
+        keys.push_back(node.key);
+        return true;
+    }));
+    REQUIRE(keys == expected);
+
+    // Fused plans run at the depth they were priced at, whatever the
+    // system's own leaf fusion depth.
+    requirements = PlanRequirements();
+    requirements.live_updates = true;
+    plan = system.plan(original, 8, requirements);
+    system.reset_stats();
+    REQUIRE(drain(system.open(plan)) == expected);
+    unsigned long long lazy_iterators = system.stats().iterators_created;
+
+    plan.engine = TraversalEngine::FUSED;
+    system.reset_stats();
+    REQUIRE(drain(system.open(plan)) == expected);
+    REQUIRE(system.stats().iterators_created < lazy_iterators);
+    plan.engine = TraversalEngine::LAZY;
+    system.reset_stats();
+    drain(system.open(plan));
+    REQUIRE(system.stats().iterators_created == lazy_iterators);
+}
+
+TEST_CASE("Histograms match a full scan of the generation", "[lsystem]") {
+    IntSystem system(sample_rules(), make_shared<ModuloIntMaterialiser>(-3, 4));
+    IntSystem::TreeNode original(1, 1);
+
+    for (unsigned int iterations = 0; iterations <= 10; ++iterations) {
+        map<int, unsigned long long> keys;
+        map<int, unsigned long long> values;
+        auto expanded = system.expand(original, static_cast<int>(iterations));
+        for (auto node = expanded.begin(); node != expanded.end(); ++node) {
+            ++keys[node->key];
+            ++values[node->value];
+        }
+
+        auto histogram = system.histogram(original, iterations);
+        REQUIRE(histogram.keys == keys);
+        REQUIRE(histogram.values == values);
+    }
+
+    unsigned long long total = 0;
+    auto histogram = system.histogram(original, 40);
+    for (auto key = histogram.keys.begin(); key != histogram.keys.end(); ++key) {
+        total += key->second;
+    }
+    REQUIRE(total == system.length(original, 40));
+}
+
+// Order-sensitive fold: a polynomial hash of the values, as (hash, base^count).
+struct ValueHash {
+    using Result = pair<unsigned long long, unsigned long long>;
+
+    Result identity() const {
+        return Result(0, 1);
+    }
+
+    Result lift(const IntSystem::TreeNode &node) const {
+        return Result(static_cast<unsigned long long>(node.value + 10), 31);
+    }
+
+    Result combine(const Result &left, const Result &right) const {
+        return Result(left.first * right.second + right.first, left.second * right.second);
+    }
+};
+
+TEST_CASE("Reductions match folding the expansion in order", "[lsystem]") {
+    IntSystem system(sample_rules(), make_shared<ModuloIntMaterialiser>(-3, 4));
+    IntSystem::TreeNode original(1, 1);
+    ValueHash monoid;
+
+    unsigned int iterations = 7;
+    auto expanded = system.expand(original, static_cast<int>(iterations));
+    auto fold = [&](size_t begin, size_t end) {
+        ValueHash::Result result = monoid.identity();
+        for (size_t j = begin; j < end; ++j) {
+            result = monoid.combine(result, monoid.lift(expanded[j]));
+        }
+        return result;
+    };
+
+    REQUIRE(system.reduce(original, iterations, monoid) == fold(0, expanded.size()));
+
+    auto summaries = system.summaries<ValueHash>();
+    for (size_t begin = 0; begin < expanded.size(); begin += 7) {
+        for (size_t end = begin; end <= expanded.size(); end += 5) {
+            REQUIRE(summaries->range(original, iterations, begin, end) == fold(begin, end));
+        }
+    }
+    REQUIRE(system.reduce<ValueHash>(original, iterations, 3, expanded.size() + 10) == fold(3, expanded.size()));
+
+    system.reset_stats();
+    auto deep = system.reduce(original, 60, monoid);
+    REQUIRE(deep.second != 0);
+    REQUIRE(system.stats().materialiser_calls < 10000);
+}
+
+TEST_CASE("Timelines find the element sounding at a time", "[lsystem]") {
+    using IntDurationSystem = System<int, Duration, ModuloValue>;
+    using R = RuleNode<int, Duration>;
+    auto rules = make_shared<IntDurationSystem::Rules>();
+    for (int key = -3; key <= 4; ++key) {
+        if (key % 2 == 0) {
+            (*rules)[key] = { R(1, Duration(1, 2)), R(2, Duration(1, 2)) };
+        } else {
+            (*rules)[key] = { R(-1, Duration(1, 3)), R(1, Duration(2, 3)) };
+        }
+    }
+
+    IntDurationSystem system(rules, make_shared<ModuloDurationMaterialiser>(-3, 4));
+    IntDurationSystem::TreeNode original(1, Duration(1), ModuloValue(1, Duration(1)));
+    ModuloDurationTiming timing;
+
+    unsigned int iterations = 8;
+    auto expanded = system.expand(original, static_cast<int>(iterations));
+    vector<double> starts;
+    double time = 0.0;
+    for (auto node = expanded.begin(); node != expanded.end(); ++node) {
+        starts.push_back(time);
+        time += timing.duration(*node);
+    }
+
+    auto timeline = system.timeline(original, iterations, timing);
+    REQUIRE(timeline->total() == Approx(time));
+    REQUIRE(timeline->locate(time + 1.0).index == expanded.size());
+
+    for (size_t j = 0; j < expanded.size(); j += 3) {
+        double t = starts[j] + timing.duration(expanded[j]) / 2;
+        REQUIRE(timeline->locate(t).index == j);
+        REQUIRE(timeline->locate(t).start == Approx(starts[j]));
+
+        auto it = system.seek_time(original, iterations, t, timing);
+        REQUIRE(it->has_next());
+        REQUIRE(it->next().value.duration.denominator == expanded[j].value.duration.denominator);
+        REQUIRE(it->advance(expanded.size()) == expanded.size() - j - 1);
+    }
+
+    size_t first = expanded.size() / 4;
+    size_t last = expanded.size() / 2;
+    double t0 = starts[first] + timing.duration(expanded[first]) / 2;
+    double t1 = starts[last] + timing.duration(expanded[last]) / 2;
+    auto overlapping = timeline->overlapping(t0, t1);
+    size_t count = 0;
+    while (overlapping->has_next()) {
+        REQUIRE(overlapping->next().value.interval == expanded[first + count].value.interval);
+        ++count;
+    }
+    REQUIRE(count == last - first + 1);
+    REQUIRE_FALSE(timeline->overlapping(t1, t0)->has_next());
+}
+
+TEST_CASE("Snapshot iterators keep the rules they started with", "[lsystem]") {
+    auto rules = sample_rules();
+    IntSystem system(rules, make_shared<ModuloIntMaterialiser>(-3, 4));
+    IntSystem::TreeNode original(1, 1);
+    auto before = keys_of(system.expand(original, 6));
+
+    auto snapshot = system.lazy_expand(original, 6, Isolation::SNAPSHOT);
+    auto live = system.lazy_expand(original, 6, Isolation::LIVE);
+    REQUIRE(snapshot->next().key == before[0]);
+    REQUIRE(system.registration_count() > 0);
+
+    // The pinned rules are copied rather than edited.
+    system.reset_stats();
+    system.update_rule(3, { 3 });
+    REQUIRE((*rules)[3].size() == 3);
+    REQUIRE(system.stats().rule_copies == 1);
+    auto after = keys_of(system.expand(original, 6));
+    REQUIRE(after != before);
+
+    vector<int> rest = drain(snapshot);
+    rest.insert(rest.begin(), before[0]);
+    REQUIRE(rest == before);
+    REQUIRE(drain(live) == after);
+
+    // Once nothing holds the pinned rules, updates edit the rules in place
+    // again.
+    snapshot = nullptr;
+    rules = nullptr;
+    system.reset_stats();
+    system.update_rule(2, { 2 });
+    REQUIRE(system.stats().rule_copies == 0);
+    auto current = system.pin_rules();
+    REQUIRE(current->at(2).size() == 1);
+    REQUIRE(current->at(3).size() == 1);
+
+    auto advanced = system.lazy_expand(original, 6, Isolation::SNAPSHOT);
+    auto expected = keys_of(system.expand(original, 6));
+    REQUIRE(advanced->advance(expected.size() / 2) == expected.size() / 2);
+    REQUIRE(advanced->next().key == expected[expected.size() / 2]);
+}
+
+TEST_CASE("Incremental jobs finish the same work in budgeted steps", "[lsystem]") {
+    IntSystem system(sample_rules(), make_shared<ModuloIntMaterialiser>(-3, 4));
+    IntSystem::TreeNode original(1, 1);
+    auto expected = keys_of(system.expand(original, 7));
+
+    auto job = system.expand_job(original, 7);
+    unsigned int steps = 0;
+    while (!job->step(WorkBudget(10))) {
+        ++steps;
+    }
+    REQUIRE(steps >= expected.size() / 10);
+    REQUIRE(job->done());
+    REQUIRE(keys_of(job->result()) == expected);
+
+    auto timed = system.expand_job(original, 7);
+    while (!timed->step(WorkBudget::of_time(chrono::microseconds(20)))) { }
+    REQUIRE(keys_of(timed->result()) == expected);
+
+    auto zero = system.expand_job(original, 0);
+    REQUIRE(zero->step(WorkBudget(1)));
+    REQUIRE(zero->result().size() == 1);
+
+    IntSystem barren(sample_rules(), make_shared<ModuloIntMaterialiser>(-3, 4));
+    barren.update_rule(1, {});
+    auto empty = barren.expand_job(original, 7);
+    REQUIRE(empty->step(WorkBudget(1)));
+    REQUIRE(empty->result().empty());
+    REQUIRE(barren.expand(original, 7).empty());
+
+    auto rules = make_shared<IntSystem::Rules>();
+    IntSystem lazy_system(rules, make_shared<ModuloIntMaterialiser>(-3, 4));
+    vector<shared_ptr<Iterator<IntSystem::TreeNode>>> iterators;
+    for (int j = 0; j < 5; ++j) {
+        iterators.push_back(lazy_system.lazy_expand(original, 7));
+    }
+    *rules = *sample_rules();
+
+    auto update = lazy_system.update_all_job();
+    steps = 0;
+    while (!update->step(WorkBudget(1))) {
+        ++steps;
+    }
+    REQUIRE(steps == 4);
+    for (auto it = iterators.begin(); it != iterators.end(); ++it) {
+        REQUIRE(drain(*it) == expected);
+    }
+}
+
+TEST_CASE("Deferred updates reach iterators when they advance", "[lsystem]") {
+    IntSystem::TreeNode original(1, 1);
+    auto traverse_with_update = [&original](bool deferred, SystemStats &update_stats) {
+        IntSystem system(sample_rules(), make_shared<ModuloIntMaterialiser>(-3, 4));
+        system.set_deferred_updates(deferred);
+        auto it = system.lazy_expand(original, 7);
+        vector<int> keys;
+        for (int j = 0; j < 40; ++j) {
+            keys.push_back(it->next().key);
+        }
+
+        system.reset_stats();
+        IntSystem::Rules batch;
+        batch[1] = { 1, 3, 2 };
+        batch[3] = { 3, 1 };
+        batch[-1] = { -3 };
+        system.update_rules(batch);
+        update_stats = system.stats();
+
+        vector<int> rest = drain(it);
+        keys.insert(keys.end(), rest.begin(), rest.end());
+        return keys;
+    };
+
+    SystemStats eager_stats;
+    SystemStats deferred_stats;
+    auto eager = traverse_with_update(false, eager_stats);
+    auto deferred = traverse_with_update(true, deferred_stats);
+    REQUIRE(deferred == eager);
+    REQUIRE(eager_stats.materialiser_calls > 0);
+    REQUIRE(deferred_stats.materialiser_calls == 0);
+    REQUIRE(deferred_stats.registrations_added == 0);
+
+    IntSystem system(make_shared<IntSystem::Rules>(), make_shared<ModuloIntMaterialiser>(-3, 4));
+    system.set_deferred_updates(true);
+    auto it = system.lazy_expand(original, 6);
+    REQUIRE(system.registration_count() == 0);
+    system.update_rules(*sample_rules());
+    IntSystem reference(sample_rules(), make_shared<ModuloIntMaterialiser>(-3, 4));
+    REQUIRE(drain(it) == keys_of(reference.expand(original, 6)));
+}
+
+TEST_CASE("Checkpoints resume traversals where they stopped", "[lsystem]") {
+    IntSystem system(sample_rules(), make_shared<ModuloIntMaterialiser>(-3, 4));
+    IntSystem::TreeNode original(1, 1);
+    vector<int> expected = keys_of(system.expand(original, 7));
+
+    for (size_t consumed : { size_t(0), size_t(1), size_t(17), expected.size() / 2, expected.size() - 1, expected.size() }) {
+        auto it = system.bounded_expand(original, 7);
+        for (size_t j = 0; j < consumed; ++j) {
+            it->next();
+        }
+        // A pending element has to survive the round trip as well.
+        it->has_next();
+
+        TraversalCheckpoint<IntSystem::TreeNode> saved;
+        REQUIRE(system.checkpoint(it, saved));
+        REQUIRE(saved.path.size() == 7);
+
+        TraversalCheckpoint<IntSystem::TreeNode> loaded;
+        REQUIRE(loaded.decode(saved.encode()));
+        REQUIRE(loaded.root.key == original.key);
+        REQUIRE(loaded.root.value == original.value);
+
+        // As after a restart: the same rules, reached through other updates.
+        IntSystem restarted(sample_rules(), make_shared<ModuloIntMaterialiser>(-3, 4));
+        restarted.update_rule(3, (*sample_rules())[3]);
+        restarted.reset_stats();
+        auto resumed = restarted.resume(loaded);
+        REQUIRE(resumed);
+        REQUIRE(restarted.stats().materialiser_calls <= 7);
+
+        vector<int> rest(expected.begin() + static_cast<long>(consumed), expected.end());
+        REQUIRE(drain(resumed) == rest);
+        REQUIRE(drain(system.resume(system.checkpoint(original, 7, consumed))) == rest);
+    }
+
+    // At depth zero the root is pending until it's consumed.
+    REQUIRE(drain(system.resume(system.checkpoint(original, 0, 0))) == vector<int>{ original.key });
+    REQUIRE(drain(system.resume(system.checkpoint(original, 0, 1))).empty());
+
+    TraversalCheckpoint<IntSystem::TreeNode> broken;
+    vector<unsigned char> bytes = system.checkpoint(original, 7, 10).encode();
+    bytes.pop_back();
+    REQUIRE_FALSE(broken.decode(bytes));
+
+    // Depths beyond what the path holds are refused before anything is built.
+    TraversalCheckpoint<IntSystem::TreeNode> hostile = system.checkpoint(original, 7, 10);
+    hostile.iterations = 1u << 30;
+    REQUIRE_FALSE(broken.decode(hostile.encode()));
+    REQUIRE_FALSE(system.resume(hostile));
+
+    // Different rules are refused even at the same version.
+    auto stale = system.checkpoint(original, 7, 10);
+    auto other_rules = sample_rules();
+    (*other_rules)[3] = { 3, 1 };
+    IntSystem other(other_rules, make_shared<ModuloIntMaterialiser>(-3, 4));
+    REQUIRE(other.rules_version() == system.rules_version());
+    REQUIRE_FALSE(other.resume(stale));
+    system.update_rule(3, { 3, 1 });
+    REQUIRE_FALSE(system.resume(stale));
+    REQUIRE_FALSE(system.checkpoint(system.lazy_expand(original, 7), stale));
+
+    using IntDurationSystem = System<int, Duration, ModuloValue>;
+    using R = RuleNode<int, Duration>;
+    auto durations = make_shared<IntDurationSystem::Rules>();
+    (*durations)[1] = { R(1, Duration(1, 2)), R(2, Duration(1, 2)) };
+    (*durations)[2] = { R(1, Duration(1, 3)), R(2, Duration(2, 3)) };
+    IntDurationSystem timed(durations, make_shared<ModuloDurationMaterialiser>(-3, 4));
+    IntDurationSystem::TreeNode start(1, Duration(1), ModuloValue(1, Duration(1)));
+    auto whole = timed.expand(start, 6);
+
+    TraversalCheckpoint<IntDurationSystem::TreeNode> decoded;
+    REQUIRE(decoded.decode(timed.checkpoint(start, 6, 10).encode()));
+    auto rest = timed.resume(decoded);
+    REQUIRE(rest);
+    for (size_t j = 10; j < whole.size(); ++j) {
+        REQUIRE(rest->next().key == whole[j].key);
+    }
+    REQUIRE_FALSE(rest->has_next());
+
+    // Durations are part of the rules.
+    auto other_durations = make_shared<IntDurationSystem::Rules>(*durations);
+    (*other_durations)[2] = { R(1, Duration(1, 3)), R(2, Duration(1, 4)) };
+    IntDurationSystem retimed(other_durations, make_shared<ModuloDurationMaterialiser>(-3, 4));
+    REQUIRE(retimed.rules_fingerprint() != timed.rules_fingerprint());
+    REQUIRE_FALSE(retimed.resume(decoded));
+}
+
+TEST_CASE("Tees give every consumer the whole expansion", "[lsystem]") {
+    IntSystem system(sample_rules(), make_shared<ModuloIntMaterialiser>(-3, 4));
+    IntSystem::TreeNode original(1, 1);
+    vector<int> expected = keys_of(system.expand(original, 7));
+
+    system.reset_stats();
+    drain(system.lazy_expand(original, 7));
+    unsigned long long single_expansion = system.stats().materialiser_calls;
+
+    system.reset_stats();
+    auto consumers = system.tee_expand(original, 7, 3, TeeMode::SINGLE_THREAD, 16);
+
+    // Reading in turn keeps the buffer to the chunks in use.
+    vector<vector<int>> keys(consumers.size());
+    size_t most_buffered = 0;
+    while (consumers[0]->has_next()) {
+        for (size_t j = 0; j < consumers.size(); ++j) {
+            keys[j].push_back(consumers[j]->next().key);
+        }
+        most_buffered = max(most_buffered, static_pointer_cast<TeeIterator<IntSystem::TreeNode>>(consumers[0])->buffered_chunks());
+    }
+    REQUIRE(most_buffered == 1);
+    for (size_t j = 0; j < consumers.size(); ++j) {
+        REQUIRE_FALSE(consumers[j]->has_next());
+        REQUIRE(keys[j] == expected);
+    }
+    REQUIRE(system.stats().materialiser_calls == single_expansion);
+
+    // A consumer that's dropped doesn't hold the rest back.
+    auto pair = tee(system.bounded_expand(original, 7), 2, TeeMode::SINGLE_THREAD, 16);
+    pair[1] = nullptr;
+    REQUIRE(drain(pair[0]) == expected);
+}
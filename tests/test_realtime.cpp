@@ -0,0 +1,51 @@
+#include "../catch/catch.hpp"
+#include "fixtures.hpp"
+
+LSYSTEM_REALTIME_ALLOCATION_TRAP
+
+static unsigned long violations = 0;
+
+static void count_violation() {
+    ++violations;
+}
+
+TEST_CASE("Real-time iterators don't allocate once built", "[realtime]") {
+    set_realtime_violation_handler(count_violation);
+    violations = 0;
+
+    IntSystem system(sample_rules(), make_shared<ModuloIntMaterialiser>(-3, 4));
+    IntSystem::TreeNode original(1, 1);
+    auto expected = system.expand(original, 8);
+    auto shorter = system.expand(original, 5);
+
+    auto it = system.realtime_expand(original, 8);
+    vector<int> keys;
+    keys.reserve(expected.size());
+    while (it->has_next()) {
+        keys.push_back(it->next().key);
+    }
+    REQUIRE(keys.size() == expected.size());
+    for (size_t j = 0; j < keys.size(); ++j) {
+        REQUIRE(keys[j] == expected[j].key);
+    }
+
+    REQUIRE(it->reseed(original, 5));
+    REQUIRE(it->advance(2) == 2);
+    keys.clear();
+    while (it->has_next()) {
+        keys.push_back(it->next().key);
+    }
+    REQUIRE(keys.size() == shorter.size() - 2);
+    REQUIRE(keys[0] == shorter[2].key);
+    REQUIRE_FALSE(it->reseed(original, 9));
+    REQUIRE(violations == 0);
+
+#ifndef NDEBUG
+    {
+        RealtimeSection section;
+        delete new int(1);
+    }
+    REQUIRE(violations == 2);
+#endif
+    set_realtime_violation_handler(abort);
+}
@@ -1,3 +1,4 @@
 #define CATCH_CONFIG_MAIN
+#define CATCH_CONFIG_NO_POSIX_SIGNALS
 
 #include "../catch/catch.hpp"
@@ -0,0 +1,129 @@
+#ifndef __MODAL_LSYSTEM_TIMELINE__
+#define __MODAL_LSYSTEM_TIMELINE__
+
+#include <memory>
+#include "lazy_iterator.hpp"
+#include "reduction.hpp"
+
+using namespace std;
+
+namespace trlsai {
+    namespace lsystem {
+        // Sums TIMING::duration(node) over a generation.
+        template <typename SYSTEM, typename TIMING>
+        struct DurationSum {
+            using Result = double;
+
+            DurationSum(TIMING timing = TIMING()): timing(timing) { }
+
+            double identity() const {
+                return 0.0;
+            }
+
+            double lift(const typename SYSTEM::TreeNode &node) const {
+                return this->timing.duration(node);
+            }
+
+            double combine(const double &left, const double &right) const {
+                return left + right;
+            }
+
+            TIMING timing;
+        };
+
+        // Element of a generation and the time it starts at. Past the end of
+        // the timeline index is the length of the generation.
+        struct TimePosition {
+            TimePosition(unsigned long long index, double start): index(index), start(start) { }
+            unsigned long long index;
+            double start;
+        };
+
+        // Lays the elements of a generation end to end, each lasting
+        // TIMING::duration(node), and finds them by time. Lookups descend from
+        // the root comparing t against the total duration of each child's
+        // subtree, so they cost depth times branching once the summaries are
+        // warm; see SubtreeSummaries.
+        template <typename SYSTEM, typename TIMING>
+        class TimelineIndex {
+        public:
+            using TreeNode = typename SYSTEM::TreeNode;
+
+            TimelineIndex(SYSTEM *system, TreeNode &original, unsigned int iterations, TIMING timing = TIMING())
+                : system(system), original(original), iterations(iterations),
+                  durations(system, DurationSum<SYSTEM, TIMING>(timing)) {
+            }
+
+            double total() {
+                return this->durations.summary(this->original, this->iterations);
+            }
+
+            // The element sounding at time t, that is, the one whose interval
+            // [start, start + duration) contains it. Times before zero map to
+            // the first element.
+            TimePosition locate(double t) {
+                auto guard = this->system->read_guard();
+                unsigned long long length = this->system->length(this->original, this->iterations);
+                double total = this->total();
+                if (t >= total) {
+                    return TimePosition(length, total);
+                }
+
+                TreeNode node = this->original;
+                unsigned int remaining = this->iterations;
+                TimePosition position(0, 0.0);
+                while (remaining > 0) {
+                    auto rule = this->system->find_rule(node.key);
+                    bool found = false;
+                    for (size_t j = 0; j < SYSTEM::child_count(rule) && !found; ++j) {
+                        TreeNode child = this->system->produce_child(node, rule, j);
+                        double duration = this->durations.summary(child, remaining - 1);
+                        if (t < position.start + duration) {
+                            node = child;
+                            found = true;
+                        } else {
+                            position.start += duration;
+                            position.index += this->system->length(child, remaining - 1);
+                        }
+                    }
+
+                    // Only reachable through rounding at the very end.
+                    if (!found) {
+                        return TimePosition(length, total);
+                    }
+                    --remaining;
+                }
+                return position;
+            }
+
+            // Iterator over the generation starting at the element sounding at t.
+            shared_ptr<Iterator<TreeNode>> seek(double t) {
+                auto it = this->system->bounded_expand(this->original, this->iterations);
+                it->advance(this->locate(t).index);
+                return it;
+            }
+
+            // Iterator over the elements overlapping [t0, t1).
+            shared_ptr<Iterator<TreeNode>> overlapping(double t0, double t1) {
+                TimePosition first = this->locate(t0);
+                TimePosition last = this->locate(t1);
+                unsigned long long end = last.index;
+                if (last.start < t1 && end < this->system->length(this->original, this->iterations)) {
+                    ++end;
+                }
+
+                auto it = this->system->bounded_expand(this->original, this->iterations);
+                it->advance(first.index);
+                return make_shared<LimitedIterator<TreeNode>>(it, t1 > t0 && end > first.index ? end - first.index : 0);
+            }
+
+        private:
+            SYSTEM *system;
+            TreeNode original;
+            unsigned int iterations;
+            SubtreeSummaries<SYSTEM, DurationSum<SYSTEM, TIMING>> durations;
+        };
+    }
+}
+
+#endif